@@ -0,0 +1,343 @@
+/**
+ * SUZUKI PLAN - MSX Disk Manager for CLI (BASIC codec benchmark)
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+// usage: basic_bench [result.json] [corpus size (KB per profile)] [corpus output directory]
+#include "../src/basic.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// 合成コーパスの生成器 (同じ seed なら常に同じプログラムを生成)
+class CorpusGenerator
+{
+  public:
+    enum Kind {
+        Keyword, // 制御文・関数呼び出し
+        Number,  // 整数・16進数・8進数・単精度・倍精度
+        String,  // 文字列リテラル
+        Comment, // REM / '
+        Data,    // DATA
+        Jump,    // GOTO / GOSUB / ON .. GOTO / IF .. THEN (行番号参照)
+        KindCount
+    };
+
+    CorpusGenerator(const int* weight, unsigned int seed) : seed(seed)
+    {
+        total = 0;
+        for (int i = 0; i < KindCount; i++) {
+            this->weight[i] = weight[i];
+            total += weight[i];
+        }
+    }
+
+    // 行番号 10, 20, 30 ... のプログラムをテキストサイズが size 程度になるまで生成
+    // (中間言語の行アドレスが 16bit に収まるように size は 24KB 程度までにすること)
+    std::string program(size_t size)
+    {
+        std::string result;
+        int lines = (int)(size / 40) + 1;
+        for (int lineNumber = 10; result.size() < size && lineNumber <= 65530; lineNumber += 10) {
+            result += std::to_string(lineNumber);
+            result += ' ';
+            int count = 1 + random(4);
+            for (int i = 0; i < count; i++) {
+                if (i) result += ':';
+                Kind kind = pickKind();
+                statement(result, kind, lineNumber, lines * 10);
+                if (Comment == kind || Data == kind) break; // 行末まで続くので以降は付けない
+            }
+            result += "\r\n";
+        }
+        return result;
+    }
+
+  private:
+    unsigned int seed;
+    int weight[KindCount];
+    int total;
+
+    int random(int n)
+    {
+        seed = seed * 1103515245 + 12345;
+        return (int)((seed >> 8) % (unsigned int)n);
+    }
+
+    Kind pickKind()
+    {
+        int r = random(total);
+        for (int i = 0; i < KindCount; i++) {
+            if (r < weight[i]) return (Kind)i;
+            r -= weight[i];
+        }
+        return Keyword;
+    }
+
+    std::string variable(const char* suffix = "")
+    {
+        std::string result(1, "ABCDNPQRSUVWXYZ"[random(15)]);
+        if (random(2)) result += (char)('0' + random(10));
+        return result + suffix;
+    }
+
+    std::string digits(int count)
+    {
+        std::string result(1, (char)('1' + random(9)));
+        while ((int)result.size() < count) result += (char)('0' + random(10));
+        return result;
+    }
+
+    std::string number()
+    {
+        char buf[32];
+        switch (random(9)) {
+            case 0: return std::to_string(random(10));
+            case 1: return std::to_string(10 + random(246));
+            case 2: return std::to_string(256 + random(32512)); // 0x1C は符号付き16bit
+            case 3: return std::to_string(65536 + random(9000000)); // 倍精度になる整数
+            case 4: snprintf(buf, sizeof(buf), "&H%X", random(65536)); return buf;
+            case 5: snprintf(buf, sizeof(buf), "&O%o", random(65536)); return buf;
+            case 6: {
+                // 単精度 (6桁以下)
+                std::string d = digits(1 + random(6));
+                size_t dot = random((int)d.size() + 1);
+                return 0 == dot ? "." + d : d.substr(0, dot) + "." + d.substr(dot);
+            }
+            case 7: {
+                // 倍精度 (7〜14桁)
+                std::string d = digits(7 + random(8));
+                size_t dot = 1 + random((int)d.size() - 1);
+                return d.substr(0, dot) + "." + d.substr(dot);
+            }
+            default: {
+                // 型宣言文字付き
+                if (random(2)) return std::to_string(random(1000)) + "!";
+                return digits(1 + random(10)) + "." + digits(1 + random(3)) + "#";
+            }
+        }
+    }
+
+    std::string text(int length)
+    {
+        static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789 .,!?-";
+        std::string result;
+        for (int i = 0; i < length; i++) result += chars[random(sizeof(chars) - 1)];
+        return result;
+    }
+
+    std::string expression()
+    {
+        static const char* functions[] = {"SIN(", "COS(", "INT(", "ABS(", "SQR(", "RND(", "PEEK(", "VPEEK(", "STICK(", "STRIG("};
+        static const char* operators[] = {"+", "-", "*", "/", "\\", "^", " AND ", " OR ", " MOD "};
+        std::string result = random(2) ? variable() : number();
+        for (int n = random(3); 0 < n; n--) {
+            result += operators[random(9)];
+            if (random(3)) {
+                result += random(2) ? variable() : number();
+            } else {
+                result += functions[random(10)] + variable() + ")";
+            }
+        }
+        return result;
+    }
+
+    void statement(std::string& line, Kind kind, int lineNumber, int lastLine)
+    {
+        switch (kind) {
+            case Keyword: {
+                switch (random(8)) {
+                    case 0: line += "FOR " + variable() + "=0 TO " + expression() + " STEP " + number(); break;
+                    case 1: line += "NEXT " + variable(); break;
+                    case 2: line += "LOCATE " + expression() + "," + expression(); break;
+                    case 3: line += "COLOR " + number() + "," + number() + "," + number(); break;
+                    case 4: line += "VPOKE " + expression() + "," + expression(); break;
+                    case 5: line += "LINE(" + expression() + "," + expression() + ")-(" + expression() + "," + expression() + ")," + number() + ",BF"; break;
+                    case 6: line += "PUT SPRITE " + number() + ",(" + variable() + "," + variable() + ")," + number(); break;
+                    default: line += variable() + "=" + expression(); break;
+                }
+                break;
+            }
+            case Number:
+                line += variable(random(2) ? "#" : "") + "=" + number() + "+" + number() + "*" + number();
+                break;
+            case String:
+                if (random(2)) {
+                    line += "PRINT \"" + text(1 + random(30)) + "\";" + variable();
+                } else {
+                    line += variable("$") + "=\"" + text(1 + random(20)) + "\"+CHR$(" + number() + ")";
+                }
+                break;
+            case Comment:
+                line += random(2) ? "REM " : "'";
+                line += text(random(60));
+                break;
+            case Data: {
+                line += "DATA ";
+                for (int n = 1 + random(12); 0 < n; n--) {
+                    line += random(4) ? number() : "\"" + text(1 + random(8)) + "\"";
+                    if (1 < n) line += ',';
+                }
+                break;
+            }
+            case Jump: {
+                int target = 10 * (1 + random(lastLine / 10));
+                switch (random(4)) {
+                    case 0: line += "GOTO " + std::to_string(target); break;
+                    case 1: line += "GOSUB " + std::to_string(target); break;
+                    case 2: line += "ON " + variable() + " GOTO " + std::to_string(target) + "," + std::to_string(lineNumber); break;
+                    default: line += "IF " + variable() + ">" + expression() + " THEN " + std::to_string(target) + " ELSE " + variable() + "=" + number(); break;
+                }
+                break;
+            }
+            default: break;
+        }
+    }
+};
+
+struct Result {
+    const char* profile;
+    size_t textBytes;
+    size_t basBytes;
+    double tokenize;   // MB/s (テキストの入力バイト数)
+    double detokenize; // MB/s (中間言語の入力バイト数)
+    bool roundTrip;
+};
+
+static double median(std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static Result benchProfile(const char* profile, const int* weight, size_t corpusSize, const char* corpusDir)
+{
+    const int rounds = 5;
+    const size_t programSize = 20 * 1024;
+    CorpusGenerator generator(weight, 0x5A4B); // 計測結果を比較できるように seed は固定
+    std::vector<std::string> sources;
+    size_t textBytes = 0;
+    while (textBytes < corpusSize) {
+        sources.push_back(generator.program(std::min(programSize, corpusSize - textBytes)));
+        textBytes += sources.back().size();
+        if (corpusDir) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%s%03d.bas", corpusDir, profile, (int)sources.size() - 1);
+            FILE* fp = fopen(path, "wb");
+            if (fp) {
+                fwrite(sources.back().data(), 1, sources.back().size(), fp);
+                fclose(fp);
+            }
+        }
+    }
+
+    BasicFilter filter;
+    BasicMemorySink bas;
+    BasicMemorySink txt;
+    std::vector<std::string> tokenized(sources.size());
+    std::vector<double> tokenize;
+    std::vector<double> detokenize;
+    Result result = {profile, textBytes, 0, 0, 0, true};
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < sources.size(); i++) {
+            BasicBufferSource source(sources[i].data(), sources[i].size());
+            bas.clear();
+            if (!filter.txt2bas(source, bas)) {
+                fprintf(stderr, "%s: cannot tokenize program #%d\n", profile, (int)i);
+                exit(1);
+            }
+            if (0 == round) tokenized[i].assign(bas.data(), bas.size());
+        }
+        tokenize.push_back(textBytes / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / 1048576.0);
+    }
+    for (auto& t : tokenized) result.basBytes += t.size();
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        for (auto& t : tokenized) {
+            txt.clear();
+            filter.bas2txt(txt, (const unsigned char*)t.data());
+        }
+        detokenize.push_back(result.basBytes / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / 1048576.0);
+    }
+    result.tokenize = median(tokenize);
+    result.detokenize = median(detokenize);
+
+    // 往復一致: 中間言語 → テキスト → 中間言語 が元の中間言語と一致すること
+    for (size_t i = 0; i < tokenized.size(); i++) {
+        txt.clear();
+        filter.bas2txt(txt, (const unsigned char*)tokenized[i].data());
+        BasicBufferSource source(txt.data(), txt.size());
+        bas.clear();
+        if (!filter.txt2bas(source, bas) || bas.size() != tokenized[i].size() || 0 != memcmp(bas.data(), tokenized[i].data(), bas.size())) {
+            fprintf(stderr, "%s: round trip mismatch in program #%d\n", profile, (int)i);
+            result.roundTrip = false;
+        }
+    }
+    printf("%-8s text %9d bytes  bas %9d bytes  tokenize %8.2f MB/s  detokenize %8.2f MB/s  round trip: %s\n", profile, (int)result.textBytes, (int)result.basBytes, result.tokenize, result.detokenize, result.roundTrip ? "OK" : "NG");
+    fflush(stdout);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* output = 1 < argc ? argv[1] : "basic_bench.json";
+    size_t corpusSize = (2 < argc ? atoi(argv[2]) : 4096) * (size_t)1024;
+    const char* corpusDir = 3 < argc ? argv[3] : nullptr;
+    if (corpusSize < 1024) corpusSize = 1024;
+
+    // 出現比率: Keyword, Number, String, Comment, Data, Jump
+    struct {
+        const char* name;
+        int weight[CorpusGenerator::KindCount];
+    } profiles[] = {
+        {"mixed", {4, 3, 2, 1, 1, 2}},
+        {"keyword", {8, 1, 1, 0, 0, 3}},
+        {"number", {1, 8, 0, 0, 3, 0}},
+        {"text", {1, 0, 4, 3, 2, 0}},
+    };
+    std::vector<Result> results;
+    for (auto& profile : profiles) {
+        results.push_back(benchProfile(profile.name, profile.weight, corpusSize, corpusDir));
+    }
+
+    FILE* fp = fopen(output, "w");
+    if (!fp) {
+        printf("cannot write %s\n", output);
+        return 1;
+    }
+    // 1行1計測の JSON (バージョン間で diff しやすいように)
+    fprintf(fp, "{\"benchmark\": \"basic\", \"corpus_kb\": %d, \"results\": [\n", (int)(corpusSize / 1024));
+    bool succeed = true;
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(fp, "  {\"profile\": \"%s\", \"text_bytes\": %d, \"bas_bytes\": %d, \"tokenize_mb_per_sec\": %.2f, \"detokenize_mb_per_sec\": %.2f, \"round_trip\": %s}%s\n", r.profile, (int)r.textBytes, (int)r.basBytes, r.tokenize, r.detokenize, r.roundTrip ? "true" : "false", i + 1 < results.size() ? "," : "");
+        succeed &= r.roundTrip;
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+    printf("saved: %s\n", output);
+    return succeed ? 0 : 1;
+}
@@ -0,0 +1,276 @@
+/**
+ * SUZUKI PLAN - MSX Disk Manager for CLI (disk operation benchmark)
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+// usage: disk_bench [result.json] [iterations]
+#include "../src/diskcommand.hpp"
+#include "../src/diskimage.hpp"
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+static FILE* report;    // stdout (the commands under test print to /dev/null)
+static char workDir[256];
+static DiskImage disk;
+
+// Bytes transferred by write system calls (sectors written by flush and the output of the commands)
+static unsigned long long getWrittenBytes()
+{
+    unsigned long long writeBytes = 0;
+    FILE* fp = fopen("/proc/self/io", "r");
+    if (!fp) return 0;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        sscanf(line, "wchar: %llu", &writeBytes);
+    }
+    fclose(fp);
+    return writeBytes;
+}
+
+static long getPeakRss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void makeLocalFile(const char* path, size_t size, unsigned int seed)
+{
+    FILE* fp = fopen(path, "wb");
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        fputc((seed >> 16) & 0xFF, fp);
+    }
+    fclose(fp);
+}
+
+// Create the image from count local files of size bytes (F000.BIN, F001.BIN, ...)
+// - fill: the size is decided from the free clusters, so the files use every cluster
+static bool makeImage(const char* image, int count, size_t size, bool fill)
+{
+    if (!disk.create(image, DiskImage::formats[1])) return false;
+    int freeCluster = disk.countFreeCluster();
+    size_t lastSize = size;
+    if (fill) {
+        // 端数のクラスタは最後のファイルに割り当てる
+        size = (size_t)(freeCluster / count) * disk.getClusterBytes();
+        lastSize = (size_t)(freeCluster - freeCluster / count * (count - 1)) * disk.getClusterBytes();
+    }
+    bool result = true;
+    for (int i = 0; result && i < count; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/F%03d.BIN", workDir, i);
+        makeLocalFile(path, i + 1 < count ? size : lastSize, i + 1);
+        result = 0 == DiskCommand::put(&disk, path, nullptr, nullptr);
+    }
+    if (result && fill && 0 != disk.countFreeCluster()) {
+        fprintf(report, "%s: %d free clusters are left\n", image, disk.countFreeCluster());
+        result = false;
+    }
+    result = result && disk.flush();
+    disk.close();
+    return result;
+}
+
+// Remove every other file and put larger files into the holes, so the chains are split
+static bool fragmentImage(const char* image, int count)
+{
+    if (!disk.open(image, true)) return false;
+    for (int i = 0; i < count; i += 2) {
+        char name[16];
+        snprintf(name, sizeof(name), "F%03d.BIN", i);
+        if (!disk.remove(name)) return false;
+    }
+    for (int i = 0; i < count / 4; i++) {
+        char path[512];
+        char as[16];
+        snprintf(path, sizeof(path), "%s/G%03d.BIN", workDir, i);
+        snprintf(as, sizeof(as), "G%03d.BIN", i);
+        makeLocalFile(path, 6000, 1000 + i);
+        if (0 != DiskCommand::put(&disk, path, as, nullptr)) return false;
+    }
+    bool result = disk.flush();
+    disk.close();
+    return result;
+}
+
+struct Result {
+    const char* image;
+    const char* op;
+    int iterations;
+    double totalSeconds;
+    double p50;
+    double p99;
+    unsigned long long bytesWritten;
+};
+
+static std::vector<Result> results;
+
+// Measure func() iterations times (prepare() is not measured, both return false on failure)
+template <typename Prepare, typename Func>
+static void measure(const char* image, const char* op, int iterations, Prepare prepare, Func func)
+{
+    std::vector<double> latency;
+    latency.reserve(iterations);
+    Result result = {image, op, iterations, 0, 0, 0, 0};
+    for (int i = 0; i < iterations; i++) {
+        if (!prepare(i)) {
+            fprintf(report, "%s/%s: failed to prepare at iteration %d\n", image, op, i);
+            exit(1);
+        }
+        unsigned long long w0 = getWrittenBytes();
+        auto t0 = std::chrono::steady_clock::now();
+        bool succeed = func(i);
+        auto t1 = std::chrono::steady_clock::now();
+        unsigned long long w1 = getWrittenBytes();
+        if (!succeed) {
+            fprintf(report, "%s/%s: failed at iteration %d\n", image, op, i);
+            exit(1);
+        }
+        latency.push_back(std::chrono::duration<double>(t1 - t0).count());
+        result.totalSeconds += latency.back();
+        result.bytesWritten += w1 - w0;
+    }
+    std::sort(latency.begin(), latency.end());
+    result.p50 = latency[iterations / 2];
+    result.p99 = latency[(iterations * 99) / 100];
+    results.push_back(result);
+    fprintf(report, "%-10s %-8s %12.1f ops/sec  p50 %9.1f us  p99 %9.1f us  written %12llu\n", image, op, iterations / result.totalSeconds, result.p50 * 1e6, result.p99 * 1e6, result.bytesWritten);
+    fflush(report);
+}
+
+template <typename Func>
+static void measure(const char* image, const char* op, int iterations, Func func)
+{
+    measure(image, op, iterations, [](int) { return true; }, func);
+}
+
+static void benchImage(const char* label, const char* image, int iterations)
+{
+    char work[512];
+    snprintf(work, sizeof(work), "%s/work.dsk", workDir);
+    char getAs[512];
+    snprintf(getAs, sizeof(getAs), "%s/get.bin", workDir);
+    char putFile[512];
+    snprintf(putFile, sizeof(putFile), "%s/PUT.BIN", workDir);
+    makeLocalFile(putFile, 3000, 77);
+
+    measure(label, "readDisk", iterations, [&](int) {
+        disk.close();
+        return disk.open(image, false);
+    });
+    // 読み込み済みのイメージに対するコマンド
+    std::vector<std::string> names;
+    const DiskImage::Directory* dir = disk.getRootDirectory();
+    for (int i = 0; i < dir->entryCount; i++) {
+        if (!dir->entries[i].removed) names.push_back(dir->entries[i].displayName);
+    }
+    measure(label, "ls", iterations, [&](int) { return 0 == DiskCommand::ls(&disk, nullptr); });
+    measure(label, "info", iterations, [&](int) { return 0 == DiskCommand::info(&disk); });
+    if (!names.empty()) {
+        measure(label, "get", iterations, [&](int i) { return 0 == DiskCommand::get(&disk, names[i % names.size()].c_str(), getAs); });
+        measure(label, "cat", iterations, [&](int i) { return 0 == DiskCommand::cat(&disk, names[i % names.size()].c_str()); });
+    }
+    disk.close();
+
+    // 書き込みは作業用のコピーに対して行い、毎回ディスクへ書き戻す
+    char command[1200];
+    snprintf(command, sizeof(command), "cp '%s' '%s'", image, work);
+    if (0 != system(command) || !disk.open(work, true)) {
+        fprintf(report, "%s: cannot open the work image\n", label);
+        exit(1);
+    }
+    bool full = 0 == disk.countFreeCluster() || disk.getRootDirectory()->entryCount == disk.getBootSector().directoryEntry;
+    if (!full) {
+        measure(label, "put", iterations, [&](int) { return 0 == DiskCommand::put(&disk, putFile, nullptr, nullptr) && disk.flush(); });
+        measure(
+            label, "rm", iterations, [&](int) { return 0 == DiskCommand::put(&disk, putFile, nullptr, nullptr) && disk.flush(); },
+            [&](int) { return 0 == DiskCommand::rm(&disk, "PUT.BIN") && disk.flush(); });
+    }
+    disk.close();
+}
+
+int main(int argc, char* argv[])
+{
+    const char* output = 1 < argc ? argv[1] : "disk_bench.json";
+    int iterations = 2 < argc ? atoi(argv[2]) : 200;
+    if (iterations < 1) iterations = 1;
+    report = fdopen(dup(1), "w");
+    if (!freopen("/dev/null", "w", stdout)) return 1;
+    strcpy(workDir, "/tmp/dskmgr-bench-XXXXXX");
+    if (!mkdtemp(workDir)) return 1;
+
+    struct {
+        const char* label;
+        int count;
+        size_t size;
+        bool fill;
+        bool fragment;
+    } images[] = {
+        {"empty", 0, 0, false, false},
+        {"full", 10, 0, true, false},
+        {"tiny", 112, 100, false, false},
+        {"large", 3, 200 * 1024, false, false},
+        {"fragment", 100, 3000, false, true},
+    };
+    for (auto& image : images) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s.dsk", workDir, image.label);
+        if (!makeImage(path, image.count, image.size, image.fill) || (image.fragment && !fragmentImage(path, image.count))) {
+            fprintf(report, "%s: cannot create the image\n", image.label);
+            return 1;
+        }
+        benchImage(image.label, path, iterations);
+    }
+
+    long peakRss = getPeakRss();
+    fprintf(report, "peak RSS: %ld KB\n", peakRss);
+    FILE* fp = fopen(output, "w");
+    if (!fp) {
+        fprintf(report, "cannot write %s\n", output);
+        return 1;
+    }
+    // 1行1計測の JSON (バージョン間で diff しやすいように)
+    fprintf(fp, "{\"benchmark\": \"disk\", \"iterations\": %d, \"peak_rss_kb\": %ld, \"results\": [\n", iterations, peakRss);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(fp, "  {\"image\": \"%s\", \"op\": \"%s\", \"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"bytes_written\": %llu}%s\n", r.image, r.op, r.iterations / r.totalSeconds, r.p50 * 1e6, r.p99 * 1e6, r.bytesWritten, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+    fprintf(report, "saved: %s\n", output);
+    char command[512];
+    snprintf(command, sizeof(command), "rm -rf '%s'", workDir);
+    return system(command);
+}
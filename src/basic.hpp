@@ -25,17 +25,398 @@
  * THE SOFTWARE.
  * -----------------------------------------------------------------------------
  */
+#ifndef INCLUDE_BASIC_HPP
+#define INCLUDE_BASIC_HPP
 #include <ctype.h>
 #include <iostream>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// 予約語テーブル (全ての BasicFilter で共有する定数データ)
+namespace BasicTable
+{
+struct StatementRecord {
+    char word[16];
+    unsigned int code;
+};
+
+// NOTE: 内容は BasicCache のキー (tableHash) に含まれるため、変更すると既存のキャッシュは使われなくなる
+constexpr StatementRecord stbl[] = {{"", 0}, {">", 0xEE}, {"CMD", 0xD7}, {"ERR", 0xE2}, {"LIST", 0x93}, {"PAINT", 0xBF}, {"SPRITE", 0xC7}, {"=", 0xEF}, {"COLOR", 0xBD}, {"ERROR", 0xA6}, {"LLIST", 0x9E}, {"PDL", 0xFFA4}, {"SQR", 0xFF87}, {"<", 0xF0}, {"CONT", 0x99}, {"EXP", 0xFF8B}, {"LOAD", 0xB5}, {"PEEK", 0xFF97}, {"STEP", 0xDC}, {"+", 0xF1}, {"COPY", 0xD6}, {"FIELD", 0xB1}, {"LOC", 0xFFAC}, {"PLAY", 0xC1}, {"STICK", 0xFFA2}, {"-", 0xF2}, {"COS", 0xFF8C}, {"FILES", 0xB7}, {"LOCATE", 0xD8}, {"POINT", 0xED}, {"STOP", 0x90}, {"*", 0xF3}, {"CSAVE", 0x9A}, {"FIX", 0xFFA1}, {"LOF", 0xFFAD}, {"POKE", 0x98}, {"STR$", 0xFF93}, {"/", 0xF4}, {"CSNG", 0xFF9F}, {"FN", 0xDE}, {"LOG", 0xFF8A}, {"POS", 0xFF91}, {"STRIG", 0xFFA3}, {"^", 0xF5}, {"CSRLIN", 0xE8}, {"FOR", 0x82}, {"LPOS", 0xFF9C}, {"PRESET", 0xC3}, {"STRING$", 0xE3}, {"\\", 0xFC}, {"CVD", 0xFFAA}, {"FPOS", 0xFFA7}, {"LPRINT", 0x9D}, {"PRINT", 0x91}, {"?", 0x91}, {"SWAP", 0xA4}, {"ABS", 0xFF86}, {"CVI", 0xFFA8}, {"FRE", 0xFF8F}, {"LSET", 0xB8}, {"PSET", 0xC2}, {"TAB(", 0xDB}, {"AND", 0xF6}, {"CVS", 0xFFA9}, {"GET", 0xB2}, {"MAX", 0xCD}, {"PUT", 0xB3}, {"TAN", 0xFF8D}, {"ASC", 0xFF95}, {"DATA", 0x84}, {"GOSUB", 0x8D}, {"MERGE", 0xB6}, {"READ", 0x87}, {"THEN", 0xDA}, {"ATN", 0xFF8E}, {"DEF", 0x97}, {"GOTO", 0x89}, {"MID$", 0xFF83}, {"REM", 0x8F}, {"TIME", 0xCB}, {"ATTR$", 0xE9}, {"DEFDBL", 0xAE}, {"HEX$", 0xFF9B}, {"MKD$", 0xFFB0}, {"RENUM", 0xAA}, {"TO", 0xD9}, {"AUTO", 0xA9}, {"DEFINT", 0xAC}, {"IF", 0x8B}, {"MKI$", 0xFFAE}, {"RESTORE", 0x8C}, {"TROFF", 0xA3}, {"BASE", 0xC9}, {"DEFSNG", 0xAD}, {"IMP", 0xFA}, {"MKS$", 0xFFAF}, {"RESUME", 0xA7}, {"TRON", 0xA2}, {"BEEP", 0xC0}, {"DEFSTR", 0xAB}, {"INKEY$", 0xEC}, {"MOD", 0xFB}, {"RETURN", 0x8E}, {"USING", 0xE4}, {"BIN$", 0xFF9D}, {"DELETE", 0xA8}, {"INP", 0xFF90}, {"MOTOR", 0xCE}, {"RIGHT$", 0xFF82}, {"USR", 0xDD}, {"BLOAD", 0xCF}, {"DIM", 0x86}, {"INPUT", 0x85}, {"NAME", 0xD3}, {"RND", 0xFF88}, {"VAL", 0xFF94}, {"BSAVE", 0xD0}, {"DRAW", 0xBE}, {"INSTR", 0xE5}, {"NEW", 0x94}, {"RSET", 0xB9}, {"VARPTR", 0xE7}, {"CALL", 0xCA}, {"DSKF", 0xFFA6}, {"INT", 0xFF85}, {"NEXT", 0x83}, {"RUN", 0x8A}, {"VDP", 0xC8}, {"CDBL", 0xFFA0}, {"DSKI$", 0xEA}, {"IPL", 0xD5}, {"NOT", 0xE0}, {"SAVE", 0xBA}, {"VPEEK", 0xFF98}, {"CHR$", 0xFF96}, {"DSKO$", 0xD1}, {"KEY", 0xCC}, {"OCT$", 0xFF9A}, {"SCREEN", 0xC5}, {"VPOKE", 0xC6}, {"CINT", 0xFF9E}, {"ELSE", 0x3AA1}, {"KILL", 0xD4}, {"OFF", 0xEB}, {"SET", 0xD2}, {"WAIT", 0x96}, {"CIRCLE", 0xBC}, {"END", 0x81}, {"LEFT$", 0xFF81}, {"ON", 0x95}, {"SGN", 0xFF84}, {"WIDTH", 0xA0}, {"CLEAR", 0x92}, {"EOF", 0xFFAB}, {"LEN", 0xFF92}, {"OPEN", 0xB0}, {"SIN", 0xFF89}, {"XOR", 0xF8}, {"CLOAD", 0x9B}, {"EQV", 0xF9}, {"LET", 0x88}, {"OR", 0xF7}, {"SOUND", 0xC4}, {"CLOSE", 0xB4}, {"ERASE", 0xA5}, {"LFILES", 0xBB}, {"OUT", 0x9C}, {"SPACE$", 0xFF99}, {"CLS", 0x9F}, {"ERL", 0xE1}, {"LINE", 0xAF}, {"PAD", 0xFFA5}, {"SPC(", 0xDF}, {"'", 0x3A8FE6}, {"", 0}};
+
+// FNV-1a hash of stbl (a part of the key of BasicCache, so editing the table invalidates the cached results)
+constexpr unsigned int makeTableHash()
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < sizeof(stbl) / sizeof(stbl[0]); i++) {
+        for (int k = 0; k < 16; k++) h = (h ^ (unsigned char)stbl[i].word[k]) * 16777619u;
+        for (int k = 0; k < 32; k += 8) h = (h ^ ((stbl[i].code >> k) & 0xFF)) * 16777619u;
+    }
+    return h;
+}
+
+constexpr unsigned int tableHash = makeTableHash();
+
+// 中間コードから stbl のインデックスを直接引くためのテーブル
+struct DecodeTable {
+    unsigned char single[256]; // 1バイトの中間コード (0x80〜0xFE)
+    unsigned char page[256];   // 0xFF xx の中間コード
+};
+
+constexpr DecodeTable makeDecodeTable()
+{
+    DecodeTable t{};
+    // 同じ中間コードの場合は先に定義されたもの (例: ? より PRINT) を優先するため逆順に設定
+    for (int i = sizeof(stbl) / sizeof(stbl[0]) - 2; 0 < i; i--) {
+        if (stbl[i].code < 0x100) {
+            t.single[stbl[i].code] = (unsigned char)i;
+        } else if (0xFF == stbl[i].code >> 8) {
+            t.page[stbl[i].code & 0xFF] = (unsigned char)i;
+        }
+    }
+    return t;
+}
+
+constexpr DecodeTable decodeTable = makeDecodeTable();
+
+// 予約語の前方一致検索用トライ木 (大文字小文字を区別しない, 文字コード 0x20〜0x5F)
+struct Trie {
+    struct Node {
+        unsigned char ch;
+        short child;   // 最初の子ノード (0: 無し)
+        short sibling; // 次の兄弟ノード (0: 無し)
+        short record;  // この文字で終わる予約語の stbl インデックス (0: 無し)
+    } node[512];
+    short root[0x40]; // 先頭文字 (0x20〜0x5F) のノード
+    int count;
+};
+
+constexpr Trie makeTrie()
+{
+    Trie t{};
+    t.count = 1; // 0 は終端として使用
+    for (int i = 1; stbl[i].code; i++) {
+        int node = 0;
+        for (int k = 0; stbl[i].word[k]; k++) {
+            unsigned char ch = (unsigned char)stbl[i].word[k];
+            int next = k ? t.node[node].child : t.root[(ch - 0x20) & 0x3F];
+            int prev = 0;
+            while (next && t.node[next].ch != ch) {
+                prev = next;
+                next = t.node[next].sibling;
+            }
+            if (!next) {
+                next = t.count++;
+                t.node[next].ch = ch;
+                if (prev) {
+                    t.node[prev].sibling = (short)next;
+                } else if (k) {
+                    t.node[node].child = (short)next;
+                } else {
+                    t.root[(ch - 0x20) & 0x3F] = (short)next;
+                }
+            }
+            node = next;
+        }
+        if (!t.node[node].record) {
+            t.node[node].record = (short)i; // 同じ綴りの場合は先に定義されたものを優先
+        }
+    }
+    return t;
+}
+
+constexpr Trie trie = makeTrie();
+} // namespace BasicTable
+
+// 中間言語からテキストへの変換結果の出力先 (バッファが一杯になると overflow を呼び出す)
+class BasicSink
+{
+  public:
+    BasicSink() {}
+    BasicSink(const BasicSink&) = delete;
+    BasicSink& operator=(const BasicSink&) = delete;
+    virtual ~BasicSink() {}
+
+    void write(const void* data, size_t size)
+    {
+        const char* ptr = (const char*)data;
+        while (capacity - length < size) {
+            size_t n = capacity - length;
+            if (n) { // 空のバッファ (buffer == nullptr) へは何もコピーしない
+                memcpy(buffer + length, ptr, n);
+                length += n;
+                ptr += n;
+                size -= n;
+            }
+            if (!overflow()) {
+                failed = true;
+                return;
+            }
+        }
+        if (size) {
+            memcpy(buffer + length, ptr, size);
+            length += size;
+        }
+    }
+
+    void put(char c)
+    {
+        if (length == capacity && !overflow()) {
+            failed = true;
+            return;
+        }
+        buffer[length++] = c;
+    }
+
+    void put(const char* str)
+    {
+        write(str, strlen(str));
+    }
+
+    void putInt(int value)
+    {
+        char tmp[12];
+        int i = sizeof(tmp);
+        unsigned int u = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+        do {
+            tmp[--i] = (char)('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (value < 0) tmp[--i] = '-';
+        write(&tmp[i], sizeof(tmp) - i);
+    }
+
+    void putHex(unsigned int value)
+    {
+        char tmp[8];
+        int i = sizeof(tmp);
+        do {
+            tmp[--i] = "0123456789ABCDEF"[value & 0x0F];
+            value >>= 4;
+        } while (value);
+        write(&tmp[i], sizeof(tmp) - i);
+    }
+
+    void putOct(unsigned int value)
+    {
+        char tmp[12];
+        int i = sizeof(tmp);
+        do {
+            tmp[--i] = (char)('0' + (value & 0x07));
+            value >>= 3;
+        } while (value);
+        write(&tmp[i], sizeof(tmp) - i);
+    }
+
+    // バッファに残っている内容を出力先へ書き出す
+    virtual void flush() {}
+
+    // 出力できなかった内容がある (メモリ不足やバッファの容量不足)
+    bool hasError() const { return failed; }
+
+  protected:
+    char* buffer = nullptr;
+    size_t length = 0;
+    size_t capacity = 0;
+    bool failed = false;
+
+    // バッファの空きを作る (false: 出力不可)
+    virtual bool overflow() = 0;
+};
+
+// メモリ上の可変長バッファへ出力
+class BasicMemorySink : public BasicSink
+{
+  public:
+    ~BasicMemorySink() override { free(buffer); }
+    const char* data() const { return buffer; }
+    size_t size() const { return length; }
+    void clear() { length = 0; }
+
+    // 出力結果の所有権を呼び出し元へ移す (free で解放, 終端に \0 を付与)
+    char* release(size_t* size)
+    {
+        put('\0');
+        char* result = buffer;
+        if (size) *size = length - 1;
+        buffer = nullptr;
+        length = capacity = 0;
+        return result;
+    }
+
+  protected:
+    bool overflow() override
+    {
+        size_t newCapacity = capacity ? capacity * 2 : 4096;
+        char* newBuffer = (char*)realloc(buffer, newCapacity);
+        if (!newBuffer) return false;
+        buffer = newBuffer;
+        capacity = newCapacity;
+        return true;
+    }
+};
+
+// FILE* またはファイルディスクリプタへ 64KB 単位で出力
+class BasicFileSink : public BasicSink
+{
+  public:
+    BasicFileSink(FILE* fp) : fp(fp), fd(-1) { setup(); }
+    BasicFileSink(int fd) : fp(nullptr), fd(fd) { setup(); }
+    ~BasicFileSink() override
+    {
+        flush();
+        free(buffer);
+    }
+
+    void flush() override
+    {
+        if (fp) {
+            fwrite(buffer, 1, length, fp);
+        } else {
+            for (size_t done = 0; done < length;) {
+                ssize_t n = ::write(fd, buffer + done, length - done);
+                if (n <= 0) break;
+                done += n;
+            }
+        }
+        length = 0;
+    }
+
+  protected:
+    bool overflow() override
+    {
+        if (!buffer) return false;
+        flush();
+        return true;
+    }
+
+  private:
+    FILE* fp;
+    int fd;
+
+    void setup()
+    {
+        buffer = (char*)malloc(65536);
+        capacity = buffer ? 65536 : 0;
+    }
+};
+
+// 呼び出し元のコールバックへ 4KB 単位で出力
+class BasicCallbackSink : public BasicSink
+{
+  public:
+    typedef void (*Callback)(void* context, const char* data, size_t size);
+    BasicCallbackSink(Callback callback, void* context) : callback(callback), context(context)
+    {
+        buffer = localBuffer;
+        capacity = sizeof(localBuffer);
+    }
+    ~BasicCallbackSink() override { flush(); }
+
+    void flush() override
+    {
+        if (length) callback(context, buffer, length);
+        length = 0;
+    }
+
+  protected:
+    bool overflow() override
+    {
+        flush();
+        return true;
+    }
+
+  private:
+    Callback callback;
+    void* context;
+    char localBuffer[4096];
+};
+
+// 呼び出し元が用意した固定長のバッファへ出力 (容量を超えた場合は hasError)
+class BasicBufferSink : public BasicSink
+{
+  public:
+    BasicBufferSink(void* buf, size_t size)
+    {
+        buffer = (char*)buf;
+        capacity = size;
+    }
+    size_t size() const { return length; }
+
+  protected:
+    bool overflow() override { return false; }
+};
+
+// テキストから中間言語への変換の入力元 (一定サイズずつ読み込む)
+class BasicSource
+{
+  public:
+    virtual ~BasicSource() {}
+    // 最大 size バイトを buf へ読み込み、読み込んだバイト数を返す (0: 終端)
+    virtual size_t read(char* buf, size_t size) = 0;
+};
+
+class BasicBufferSource : public BasicSource
+{
+  public:
+    BasicBufferSource(const char* src, size_t size) : src(src), remain(size) {}
+    size_t read(char* buf, size_t size) override
+    {
+        size_t n = remain < size ? remain : size;
+        memcpy(buf, src, n);
+        src += n;
+        remain -= n;
+        return n;
+    }
+
+  private:
+    const char* src;
+    size_t remain;
+};
+
+class BasicFileSource : public BasicSource
+{
+  public:
+    BasicFileSource(FILE* fp) : fp(fp), fd(-1) {}
+    BasicFileSource(int fd) : fp(nullptr), fd(fd) {}
+    size_t read(char* buf, size_t size) override
+    {
+        if (fp) return fread(buf, 1, size, fp);
+        ssize_t n = ::read(fd, buf, size);
+        return n < 0 ? 0 : (size_t)n;
+    }
+
+  private:
+    FILE* fp;
+    int fd;
+};
 
 class BasicFilter
 {
   public:
+    // Version of the txt2bas output (increment when the same text is converted to a different intermediate code)
+    // - Changes of the reserved word table (BasicTable::stbl) are detected by BasicTable::tableHash
+    // - Changes of the conversion logic (txt2basLine and the number encoding) need this increment
+    static constexpr int tokenizerVersion = 1;
+
     void bas2txt(FILE* stream, unsigned char* cBuf)
+    {
+        BasicFileSink sink(stream);
+        bas2txt(sink, cBuf);
+    }
+
+    // 中間言語からテキストへ変換した結果を返す (free で解放)
+    char* bas2txt(const unsigned char* cBuf, size_t* txtSize)
+    {
+        BasicMemorySink sink;
+        bas2txt(sink, cBuf);
+        return sink.release(txtSize);
+    }
+
+    void bas2txt(BasicSink& sink, const unsigned char* cBuf)
     {
         int x;
         int lp;
@@ -44,8 +425,6 @@ class BasicFilter
         int scode;
         int ivalue, linevalue;
         short svalue;
-        char tmpc[32];
-        int itmp;
 
         x = 1;
         ofs = 0x8000;
@@ -54,48 +433,53 @@ class BasicFilter
         while (lp != 0) {
             lineNum = (cBuf[x + 1] << 8) | cBuf[x];
             x += 2;
-            fprintf(stream, "%d ", lineNum);
+            sink.putInt(lineNum);
+            sink.put(' ');
             while (cBuf[x]) {
                 scode = cBuf[x++];
                 switch (scode) {
                     case 0xff:
-                        scode = (scode << 8) | (cBuf[x++]);
-                        fprintf(stream, "%s", getStatementFromCode(scode)->word);
+                        sink.put(BasicTable::stbl[BasicTable::decodeTable.page[cBuf[x++]]].word);
                         break;
                     case 0x3a:
                         if (cBuf[x] == 0xA1) {
                             x++;
-                            scode = 0x3AA1; // else
-                            fprintf(stream, "%s", getStatementFromCode(scode)->word);
+                            sink.put("ELSE"); // 3A A1
                         } else if (cBuf[x] == 0x8F && cBuf[x + 1] == 0xE6) {
                             x += 2;
-                            scode = 0x3A8FE6; // '
-                            fprintf(stream, "%s", getStatementFromCode(scode)->word);
+                            sink.put('\''); // 3A 8F E6
                         } else {
-                            fprintf(stream, ":");
+                            sink.put(':');
                         }
                         break;
+                    case 0x0b: //oct num
+                        ivalue = (cBuf[x]) | (cBuf[x + 1] << 8);
+                        x += 2;
+                        sink.put("&O");
+                        sink.putOct(ivalue);
+                        break;
                     case 0x0c: //hex num
                         ivalue = (cBuf[x]) | (cBuf[x + 1] << 8);
                         x += 2;
-                        fprintf(stream, "&H%X", ivalue);
+                        sink.put("&H");
+                        sink.putHex(ivalue);
                         break;
                     case 0x0e: //line num(line)
                         ivalue = (cBuf[x]) | (cBuf[x + 1] << 8);
                         x += 2;
-                        fprintf(stream, "%d", ivalue);
+                        sink.putInt(ivalue);
                         break;
                     case 0x0d: //line num(addr)
                         ivalue = (cBuf[x]) | (cBuf[x + 1] << 8);
                         ivalue -= ofs;
                         linevalue = (cBuf[ivalue]) | (cBuf[ivalue + 1] << 8);
-                        fprintf(stream, "%d", linevalue);
+                        sink.putInt(linevalue);
                         x += 2;
                         break;
                     case 0x0f: //num 10-255
                         ivalue = (cBuf[x]);
                         x += 1;
-                        fprintf(stream, "%d", ivalue);
+                        sink.putInt(ivalue);
                         break;
                     case 0x11: //num 0
                     case 0x12: //num 1
@@ -107,277 +491,273 @@ class BasicFilter
                     case 0x18: //num 7
                     case 0x19: //num 8
                     case 0x1a: //num 9
-                        fprintf(stream, "%d", scode - 0x11);
+                        sink.put((char)('0' + scode - 0x11));
                         break;
                     case 0x1c: //int num
                         svalue = (cBuf[x]) | (cBuf[x + 1] << 8);
                         x += 2;
-                        fprintf(stream, "%d", (int)svalue);
+                        sink.putInt(svalue);
                         break;
                     case 0x1d: //単精度BCD浮動小数点数
                     {
-                        fprintf(stream, "%s!", bcdFloatToString(&cBuf[x]));
+                        char bcd[96];
+                        sink.write(bcd, bcdToString(&cBuf[x], 6, bcd));
+                        sink.put('!');
                         x += 4;
                         break;
                     }
                     case 0x1f: //倍精度BCD浮動小数点数
                     {
-                        fprintf(stream, "%s#", bcdDoubleToString(&cBuf[x]));
+                        char bcd[96];
+                        sink.write(bcd, bcdToString(&cBuf[x], 14, bcd));
+                        sink.put('#');
                         x += 8;
                         break;
                     }
                     default:
                         if (scode < 0x80) {
-                            fputc(scode, stream);
+                            sink.put((char)scode);
                         } else {
-                            fprintf(stream, "%s", getStatementFromCode(scode)->word);
+                            sink.put(BasicTable::stbl[BasicTable::decodeTable.single[scode]].word);
                         }
                         break;
                 }
             }
-            fprintf(stream, "\n");
+            sink.put('\n');
             x = lp - ofs;
             lp = (cBuf[x + 1] << 8) | cBuf[x];
             x += 2;
         }
+        sink.flush();
     }
 
     unsigned char* txt2bas(const char* src, size_t* basSize)
     {
-        if (0xFF == (unsigned char)src[0] || 0x00 == (unsigned char)src[0]) return nullptr;
-        size_t len = strlen(src);
-        char* text = (char*)malloc(len + 1);
-        if (!text) {
-            puts("No memory");
-            return nullptr;
-        }
-        strcpy(text, src);
-        unsigned char* result = (unsigned char*)malloc(len + 1);
-        if (!result) {
-            puts("No memory");
-            free(text);
-            return nullptr;
-        }
-        int ptr = 0;
-        int ln = 0;
-        unsigned short offset;
-        int optr;
-        result[ptr++] = 0xFF;
-        char* line = strtok(text, "\n");
-        while (line) {
-            ln++;
-            // CRLFがある場合は潰しておく
-            char* cp = strchr(line, '\r');
-            if (cp) *cp = 0;
-            cp = strchr(line, '\n');
-            if (cp) *cp = 0;
-            trimstring(line);
-
-            // 空行はスキップ
-            trimstring(line);
-            if (0 == *line) {
-                line = strtok(NULL, "\n");
-                continue;
-            }
+        BasicBufferSource source(src, strlen(src));
+        BasicMemorySink sink;
+        if (!txt2bas(source, sink)) return nullptr;
+        return (unsigned char*)sink.release(basSize);
+    }
 
-            // オフセット更新
-            if (1 < ptr) {
-                offset = 0x8000 + ptr;
-                memcpy(&result[optr], &offset, 2);
+    // テキスト形式のBASICを一定サイズずつ読み込みながら中間言語に変換して sink へ出力
+    // (テキスト形式でない場合、行番号が不正な場合、出力できなかった場合は false)
+    bool txt2bas(BasicSource& source, BasicSink& sink)
+    {
+        char chunk[16384];
+        size_t size = source.read(chunk, sizeof(chunk));
+        if (0 == size || 0xFF == (unsigned char)chunk[0] || 0x00 == (unsigned char)chunk[0]) return false;
+        BasicMemorySink line;  // 読み込み中の行
+        BasicMemorySink token; // 変換中の行の中間言語
+        unsigned short address = 1;
+        bool result = true;
+        sink.put((char)0xFF);
+        while (result) {
+            // 改行までを line に蓄積し、1行ずつ変換する
+            const char* cp = chunk;
+            const char* end = chunk + size;
+            while (result && cp < end) {
+                const char* lf = (const char*)memchr(cp, '\n', end - cp);
+                line.write(cp, (lf ? lf : end) - cp);
+                if (!lf) break;
+                result = txt2basLine(line, token, sink, &address);
+                cp = lf + 1;
             }
-            optr = ptr;
-            result[ptr++] = 0xFF; // dummy (current offset)
-            result[ptr++] = 0xFF; // dummy (current offset)
-
-            // 行番号を取得
-            int lineNumber = atoi(line);
-            if (lineNumber < 1 || 65535 < lineNumber) {
-                free(text);
-                free(result);
-                return nullptr;
+            if (!result || 0 == size) break;
+            size = source.read(chunk, sizeof(chunk));
+            if (0 == size) {
+                result = txt2basLine(line, token, sink, &address);
             }
-            while (isdigit(*line)) line++;
-            trimstring(line);
-            result[ptr++] = lineNumber & 0x00FF;
-            result[ptr++] = (lineNumber & 0xFF00) >> 8;
-
-            // 構文解析
-            while (*line) {
-                // ダブルクォーテーションで囲まれている範囲をそのまま出力
-                if ('"' == *line) {
-                    result[ptr++] = '"';
-                    for (++line; *line && *line != '"'; line++) {
-                        result[ptr++] = *line;
-                    }
-                    if (*line == '"') {
-                        result[ptr++] = '"';
-                        line++;
-                    }
-                    continue;
-                }
-                // ステートメント解析
-                auto st = getStatementFromWord(line);
-                if (0 < st->code) {
-                    if (st->code < 0x100) {
-                        // single byte statement
-                        result[ptr++] = (unsigned char)(st->code & 0xFF);
-                    } else if (st->code < 0x10000) {
-                        // 2 bytes statement
-                        result[ptr++] = (unsigned char)((st->code & 0xFF00) >> 8);
-                        result[ptr++] = (unsigned char)(st->code & 0xFF);
-                    } else if (st->code < 0x1000000) {
-                        // 3 bytes statement
-                        result[ptr++] = (unsigned char)((st->code & 0xFF0000) >> 16);
-                        result[ptr++] = (unsigned char)((st->code & 0xFF00) >> 8);
-                        result[ptr++] = (unsigned char)(st->code & 0xFF);
-                    } else {
-                        // 4 bytes statement
-                        result[ptr++] = (unsigned char)((st->code & 0xFF000000) >> 24);
-                        result[ptr++] = (unsigned char)((st->code & 0xFF0000) >> 16);
-                        result[ptr++] = (unsigned char)((st->code & 0xFF00) >> 8);
-                        result[ptr++] = (unsigned char)(st->code & 0xFF);
-                    }
-                    line += strlen(st->word);
-                    if (st->code == 0x8F || st->code == 0x84 || st->code == 0x3A8FE6) {
-                        // REM (コメント) or DATA を検出したので行末までそのまま出力
-                        while (*line) {
-                            result[ptr++] = *line;
-                            line++;
-                        }
-                    } else if (st->code == 0xD2) {
-                        // SET を検出したので , : or 行末までそのまま出力
-                        while (*line && ',' != *line && ':') {
-                            result[ptr++] = *line;
-                            line++;
-                        }
-                    } else if (st->code == 0x89 || st->code == 0x8D || st->code == 0x8C || st->code == 0xA7 || st->code == 0x93) {
-                        // GOTO/GOSUB/RESTORE/RESUME/LIST を検出したので行番号を出力
-                        while (' ' == *line || '\t' == *line) {
-                            result[ptr++] = ' ';
-                            line++;
-                        }
-                        int i = atoi(line);
-                        if (i) {
-                            result[ptr++] = 0x0E;
-                            result[ptr++] = i & 0xFF;
-                            result[ptr++] = (i >> 8) & 0xFF;
-                            while (isdigit(*line)) line++;
-                        }
-                    }
-                    continue;
-                }
-                // 8進数解析
-                if (0 == strncasecmp(line, "&O", 2)) {
-                    line += 2;
-                    int len = 0;
-                    auto hex = oct2i(line, &len);
-                    line += len;
-                    result[ptr++] = 0x0B;
-                    result[ptr++] = (unsigned char)(hex & 0xFF);
-                    result[ptr++] = (unsigned char)((hex & 0xFF00) >> 8);
-                    continue;
+        }
+        if (result) {
+            sink.put('\0');
+            sink.put('\0');
+            sink.flush();
+        }
+        return result && !sink.hasError() && !line.hasError() && !token.hasError();
+    }
+
+    void txt2bas_free(unsigned char* bas)
+    {
+        free(bas);
+    }
+
+  private:
+    // line に蓄積した1行を中間言語に変換して sink へ出力 (line はクリアされる)
+    bool txt2basLine(BasicMemorySink& lineBuffer, BasicMemorySink& out, BasicSink& sink, unsigned short* address)
+    {
+        lineBuffer.put('\0');
+        if (lineBuffer.hasError()) return false;
+        char* line = (char*)lineBuffer.data();
+        lineBuffer.clear();
+        // CRがある場合は潰しておく
+        char* cp = strchr(line, '\r');
+        if (cp) *cp = 0;
+        trimstring(line);
+
+        // 空行はスキップ
+        if (0 == *line) {
+            return true;
+        }
+
+        // 行番号を取得
+        int lineNumber = atoi(line);
+        if (lineNumber < 1 || 65535 < lineNumber) {
+            return false;
+        }
+        while (isdigit(*line)) line++;
+        trimstring(line);
+        const char* end = line + strlen(line);
+        out.clear();
+        out.put(lineNumber & 0x00FF);
+        out.put((lineNumber & 0xFF00) >> 8);
+
+        // 構文解析
+        while (*line) {
+            // ダブルクォーテーションで囲まれている範囲をそのまま出力
+            if ('"' == *line) {
+                const char* quote = (const char*)memchr(line + 1, '"', end - line - 1);
+                const char* next = quote ? quote + 1 : end;
+                out.write(line, next - line);
+                line += next - line;
+                continue;
+            }
+            // ステートメント解析
+            auto st = getStatementFromWord(line);
+            if (0 < st->code) {
+                if (st->code < 0x100) {
+                    // single byte statement
+                    out.put((char)(st->code & 0xFF));
+                } else if (st->code < 0x10000) {
+                    // 2 bytes statement
+                    out.put((char)((st->code & 0xFF00) >> 8));
+                    out.put((char)(st->code & 0xFF));
+                } else if (st->code < 0x1000000) {
+                    // 3 bytes statement
+                    out.put((char)((st->code & 0xFF0000) >> 16));
+                    out.put((char)((st->code & 0xFF00) >> 8));
+                    out.put((char)(st->code & 0xFF));
+                } else {
+                    // 4 bytes statement
+                    out.put((char)((st->code & 0xFF000000) >> 24));
+                    out.put((char)((st->code & 0xFF0000) >> 16));
+                    out.put((char)((st->code & 0xFF00) >> 8));
+                    out.put((char)(st->code & 0xFF));
                 }
-                // 16進数変換
-                if (0 == strncasecmp(line, "&H", 2)) {
-                    line += 2;
-                    int len = 0;
-                    auto hex = hex2i(line, &len);
+                line += strlen(st->word);
+                if (st->code == 0x8F || st->code == 0x84 || st->code == 0x3A8FE6) {
+                    // REM (コメント) or DATA を検出したので行末までそのまま出力
+                    out.write(line, end - line);
+                    line += end - line;
+                } else if (st->code == 0xD2) {
+                    // SET を検出したので , : or 行末までそのまま出力
+                    size_t len = strcspn(line, ",:");
+                    out.write(line, len);
                     line += len;
-                    result[ptr++] = 0x0C;
-                    result[ptr++] = (unsigned char)(hex & 0xFF);
-                    result[ptr++] = (unsigned char)((hex & 0xFF00) >> 8);
-                    continue;
-                }
-                // 2進数変換
-                if (0 == strncasecmp(line, "&B", 2)) {
-                    line += 2;
-                    result[ptr++] = '&';
-                    result[ptr++] = 'B';
-                    while ('0' == *line || '1' == *line) {
-                        result[ptr++] = *line;
-                    }
-                    continue;
-                }
-                // 実数 (単精度 or 倍精度のBCD浮動小数点数)
-                if (isDouble(line) || isFloat(line)) {
-                    bool isDouble = this->isDouble(line);
-                    result[ptr++] = isDouble ? 0x1F : 0x1D;
-                    // 数字列切り出し
-                    char fstr[128];
-                    memset(fstr, 0, sizeof(fstr));
-                    int fptr = 0;
-                    while (fptr < sizeof(fstr) - 1 && (isdigit(*line) || '.' == *line)) {
-                        fstr[fptr++] = *line;
+                } else if (st->code == 0x89 || st->code == 0x8D || st->code == 0x8C || st->code == 0xA7 || st->code == 0x93) {
+                    // GOTO/GOSUB/RESTORE/RESUME/LIST を検出したので行番号を出力
+                    while (' ' == *line || '\t' == *line) {
+                        out.put(' ');
                         line++;
                     }
-                    if (*line == '!' || *line == '#') line++;
-                    makeBcdFloat(fstr, &result[ptr], isDouble);
-                    ptr += isDouble ? 8 : 4;
-                    continue;
-                }
-                // 10進数変換
-                if (isdigit(*line)) {
                     int i = atoi(line);
-                    if (i < 10) {
-                        result[ptr++] = 0x11 + i;
-                    } else if (i < 256) {
-                        result[ptr++] = 0x0F;
-                        result[ptr++] = i & 0xFF;
-                    } else if (i < 65536) {
-                        result[ptr++] = 0x1C;
-                        result[ptr++] = i & 0xFF;
-                        result[ptr++] = (i >> 8) & 0xFF;
-                    } else {
-                        // 2バイトに収まりきらないので実数にする
-                        result[ptr++] = 0x1F;
-                        char fstr[128];
-                        memset(fstr, 0, sizeof(fstr));
-                        int fptr = 0;
-                        while (fptr < sizeof(fstr) - 1 && (isdigit(*line) || '.' == *line)) {
-                            fstr[fptr++] = *line;
-                            line++;
-                        }
-                        makeBcdFloat(fstr, &result[ptr], true);
-                        ptr += 8;
+                    if (i) {
+                        out.put(0x0E);
+                        out.put(i & 0xFF);
+                        out.put((i >> 8) & 0xFF);
+                        while (isdigit(*line)) line++;
                     }
-                    while (isdigit(*line)) line++;
-                    continue;
                 }
-                // 英数字
-                if (isalpha(*line)) {
-                    while (isalnum(*line)) {
-                        result[ptr++] = *line;
-                        line++;
-                    }
-                    continue;
+                continue;
+            }
+            // 8進数解析
+            if (0 == strncasecmp(line, "&O", 2)) {
+                line += 2;
+                int len = 0;
+                auto hex = oct2i(line, &len);
+                line += len;
+                out.put(0x0B);
+                out.put((char)(hex & 0xFF));
+                out.put((char)((hex & 0xFF00) >> 8));
+                continue;
+            }
+            // 16進数変換
+            if (0 == strncasecmp(line, "&H", 2)) {
+                line += 2;
+                int len = 0;
+                auto hex = hex2i(line, &len);
+                line += len;
+                out.put(0x0C);
+                out.put((char)(hex & 0xFF));
+                out.put((char)((hex & 0xFF00) >> 8));
+                continue;
+            }
+            // 2進数変換
+            if (0 == strncasecmp(line, "&B", 2)) {
+                out.write(line, 2);
+                line += 2;
+                size_t len = strspn(line, "01");
+                out.write(line, len);
+                line += len;
+                continue;
+            }
+            // 実数 (単精度 or 倍精度のBCD浮動小数点数)
+            if (isDouble(line) || isFloat(line)) {
+                bool isDouble = this->isDouble(line);
+                out.put(isDouble ? 0x1F : 0x1D);
+                // 数字列切り出し
+                size_t len = numberLength(line);
+                unsigned char bcd[8];
+                makeBcdFloat(line, len, bcd, isDouble);
+                line += len;
+                if (*line == '!' || *line == '#') line++;
+                out.write(bcd, isDouble ? 8 : 4);
+                continue;
+            }
+            // 10進数変換
+            if (isdigit(*line)) {
+                int i = atoi(line);
+                if (i < 10) {
+                    out.put(0x11 + i);
+                } else if (i < 256) {
+                    out.put(0x0F);
+                    out.put(i & 0xFF);
+                } else if (i < 65536) {
+                    out.put(0x1C);
+                    out.put(i & 0xFF);
+                    out.put((i >> 8) & 0xFF);
+                } else {
+                    // 2バイトに収まりきらないので実数にする
+                    out.put(0x1F);
+                    size_t len = numberLength(line);
+                    unsigned char bcd[8];
+                    makeBcdFloat(line, len, bcd, true);
+                    line += len;
+                    out.write(bcd, 8);
                 }
-                // 何れにも該当しない (そのまま出力)
-                result[ptr++] = *line;
-                line++;
+                while (isdigit(*line)) line++;
+                continue;
             }
-            result[ptr++] = 0;
-            offset = 0x8000 + ptr;
-            memcpy(&result[optr], &offset, 2);
-            line = strtok(NULL, "\n");
-        }
-        result[ptr++] = 0;
-        result[ptr++] = 0;
-        *basSize = ptr;
-        free(text);
-        return result;
-    }
+            // 英数字
+            if (isalpha(*line)) {
+                const char* word = line;
+                while (isalnum(*line)) line++;
+                out.write(word, line - word);
+                continue;
+            }
+            // 何れにも該当しない (そのまま出力)
+            out.put(*line);
+            line++;
+        }
+        out.put('\0');
 
-    void txt2bas_free(unsigned char* bas)
-    {
-        free(bas);
+        // 次の行のアドレス (0x8000 + 先頭からのオフセット) を付けて出力
+        *address += 2 + (unsigned short)out.size();
+        unsigned short link = 0x8000 + *address;
+        sink.write(&link, 2);
+        sink.write(out.data(), out.size());
+        return !out.hasError();
     }
 
-  private:
-    struct StatementRecord {
-        char word[16];
-        unsigned int code;
-    } stbl[256] = {{"", 0}, {">", 0xEE}, {"CMD", 0xD7}, {"ERR", 0xE2}, {"LIST", 0x93}, {"PAINT", 0xBF}, {"SPRITE", 0xC7}, {"=", 0xEF}, {"COLOR", 0xBD}, {"ERROR", 0xA6}, {"LLIST", 0x9E}, {"PDL", 0xFFA4}, {"SQR", 0xFF87}, {"<", 0xF0}, {"CONT", 0x99}, {"EXP", 0xFF8B}, {"LOAD", 0xB5}, {"PEEK", 0xFF97}, {"STEP", 0xDC}, {"+", 0xF1}, {"COPY", 0xD6}, {"FIELD", 0xB1}, {"LOC", 0xFFAC}, {"PLAY", 0xC1}, {"STICK", 0xFFA2}, {"-", 0xF2}, {"COS", 0xFF8C}, {"FILES", 0xB7}, {"LOCATE", 0xD8}, {"POINT", 0xED}, {"STOP", 0x90}, {"*", 0xF3}, {"CSAVE", 0x9A}, {"FIX", 0xFFA1}, {"LOF", 0xFFAD}, {"POKE", 0x98}, {"STR$", 0xFF93}, {"/", 0xF4}, {"CSNG", 0xFF9F}, {"FN", 0xDE}, {"LOG", 0xFF8A}, {"POS", 0xFF91}, {"STRIG", 0xFFA3}, {"^", 0xF5}, {"CSRLIN", 0xE8}, {"FOR", 0x82}, {"LPOS", 0xFF9C}, {"PRESET", 0xC3}, {"STRING$", 0xE3}, {"\\", 0xFC}, {"CVD", 0xFFAA}, {"FPOS", 0xFFA7}, {"LPRINT", 0x9D}, {"PRINT", 0x91}, {"?", 0x91}, {"SWAP", 0xA4}, {"ABS", 0xFF86}, {"CVI", 0xFFA8}, {"FRE", 0xFF8F}, {"LSET", 0xB8}, {"PSET", 0xC2}, {"TAB(", 0xDB}, {"AND", 0xF6}, {"CVS", 0xFFA9}, {"GET", 0xB2}, {"MAX", 0xCD}, {"PUT", 0xB3}, {"TAN", 0xFF8D}, {"ASC", 0xFF95}, {"DATA", 0x84}, {"GOSUB", 0x8D}, {"MERGE", 0xB6}, {"READ", 0x87}, {"THEN", 0xDA}, {"ATN", 0xFF8E}, {"DEF", 0x97}, {"GOTO", 0x89}, {"MID$", 0xFF83}, {"REM", 0x8F}, {"TIME", 0xCB}, {"ATTR$", 0xE9}, {"DEFDBL", 0xAE}, {"HEX$", 0xFF9B}, {"MKD$", 0xFFB0}, {"RENUM", 0xAA}, {"TO", 0xD9}, {"AUTO", 0xA9}, {"DEFINT", 0xAC}, {"IF", 0x8B}, {"MKI$", 0xFFAE}, {"RESTORE", 0x8C}, {"TROFF", 0xA3}, {"BASE", 0xC9}, {"DEFSNG", 0xAD}, {"IMP", 0xFA}, {"MKS$", 0xFFAF}, {"RESUME", 0xA7}, {"TRON", 0xA2}, {"BEEP", 0xC0}, {"DEFSTR", 0xAB}, {"INKEY$", 0xEC}, {"MOD", 0xFB}, {"RETURN", 0x8E}, {"USING", 0xE4}, {"BIN$", 0xFF9D}, {"DELETE", 0xA8}, {"INP", 0xFF90}, {"MOTOR", 0xCE}, {"RIGHT$", 0xFF82}, {"USR", 0xDD}, {"BLOAD", 0xCF}, {"DIM", 0x86}, {"INPUT", 0x85}, {"NAME", 0xD3}, {"RND", 0xFF88}, {"VAL", 0xFF94}, {"BSAVE", 0xD0}, {"DRAW", 0xBE}, {"INSTR", 0xE5}, {"NEW", 0x94}, {"RSET", 0xB9}, {"VARPTR", 0xE7}, {"CALL", 0xCA}, {"DSKF", 0xFFA6}, {"INT", 0xFF85}, {"NEXT", 0x83}, {"RUN", 0x8A}, {"VDP", 0xC8}, {"CDBL", 0xFFA0}, {"DSKI$", 0xEA}, {"IPL", 0xD5}, {"NOT", 0xE0}, {"SAVE", 0xBA}, {"VPEEK", 0xFF98}, {"CHR$", 0xFF96}, {"DSKO$", 0xD1}, {"KEY", 0xCC}, {"OCT$", 0xFF9A}, {"SCREEN", 0xC5}, {"VPOKE", 0xC6}, {"CINT", 0xFF9E}, {"ELSE", 0x3AA1}, {"KILL", 0xD4}, {"OFF", 0xEB}, {"SET", 0xD2}, {"WAIT", 0x96}, {"CIRCLE", 0xBC}, {"END", 0x81}, {"LEFT$", 0xFF81}, {"ON", 0x95}, {"SGN", 0xFF84}, {"WIDTH", 0xA0}, {"CLEAR", 0x92}, {"EOF", 0xFFAB}, {"LEN", 0xFF92}, {"OPEN", 0xB0}, {"SIN", 0xFF89}, {"XOR", 0xF8}, {"CLOAD", 0x9B}, {"EQV", 0xF9}, {"LET", 0x88}, {"OR", 0xF7}, {"SOUND", 0xC4}, {"CLOSE", 0xB4}, {"ERASE", 0xA5}, {"LFILES", 0xBB}, {"OUT", 0x9C}, {"SPACE$", 0xFF99}, {"CLS", 0x9F}, {"ERL", 0xE1}, {"LINE", 0xAF}, {"PAD", 0xFFA5}, {"SPC(", 0xDF}, {"'", 0x3A8FE6}, {"", 0}};
-
     bool isDouble(const char* str)
     {
         int dot = 0;
@@ -415,184 +795,138 @@ class BasicFilter
         return true;
     }
 
+    // 実数として切り出す数字と小数点の列の長さ (最大127文字)
+    size_t numberLength(const char* str)
+    {
+        size_t len = 0;
+        while (len < 127 && (isdigit(str[len]) || '.' == str[len])) len++;
+        return len;
+    }
+
     bool isDecimal(const char* str)
     {
         return isdigit(*str);
     }
 
-    const char* bcdFloatToString(const unsigned char* buf)
+    // BCD浮動小数点数 (指数部1バイト + 仮数部 digits / 2 バイト) を result へテキストで出力して長さを返す
+    // (result は digits + 65 バイト以上: 指数部が最小の時 "." + 0 が64個 + 仮数部)
+    int bcdToString(const unsigned char* buf, int digits, char* result)
     {
-        static char result[256];
-        char fmt[256];
         if (0 == buf[0]) {
-            strcpy(result, "0");
-            return result;
-        }
-        char n[6];
-        for (int i = 0; i < 3; i++) {
-            n[i * 2] = '0' + ((buf[i + 1] & 0xF0) >> 4);
-            n[i * 2 + 1] = '0' + (buf[i + 1] & 0x0F);
+            result[0] = '0';
+            return 1;
         }
+        // 先頭の0・末尾の0を除く前の形式 (整数部, 小数点, 小数部) を組み立てる
+        char work[96];
+        char* cp = work;
         int pw = buf[0] & 0x7F;
         if (pw & 0x40) {
             pw &= 0x3F;
-            switch (pw) {
-                case 6: strcpy(fmt, "%c%c%c%c%c%c"); break;
-                case 5: strcpy(fmt, "%c%c%c%c%c.%c"); break;
-                case 4: strcpy(fmt, "%c%c%c%c.%c%c"); break;
-                case 3: strcpy(fmt, "%c%c%c.%c%c%c"); break;
-                case 2: strcpy(fmt, "%c%c.%c%c%c%c"); break;
-                case 1: strcpy(fmt, "%c.%c%c%c%c%c"); break;
-                case 0: strcpy(fmt, ".%c%c%c%c%c%c"); break;
-                default: {
-                    strcpy(fmt, "%c%c%c%c%c%c");
-                    for (; 6 < pw; pw--) {
-                        strcat(fmt, "0");
-                    }
-                }
-            }
         } else {
-            pw ^= 0x3F;
-            strcpy(fmt, ".");
-            for (; 0 <= pw; pw--) {
-                strcat(fmt, "0");
-            }
-            strcat(fmt, "%c%c%c%c%c%c");
+            *cp++ = '.';
+            memset(cp, '0', 64 - pw); // 0.000ddd (10 の pw - 64 乗)
+            cp += 64 - pw;
+            pw = -1;
         }
-        snprintf(result, sizeof(result), fmt, n[0], n[1], n[2], n[3], n[4], n[5]);
-        trimnum(result);
-        return result;
-    }
-
-    const char* bcdDoubleToString(const unsigned char* buf)
-    {
-        static char result[512];
-        char fmt[512];
-        if (0 == buf[0]) {
-            strcpy(result, "0");
-            return result;
+        for (int i = 0; i < digits; i++) {
+            if (i == pw) *cp++ = '.';
+            unsigned char bcd = buf[1 + i / 2];
+            *cp++ = (char)('0' + (i & 1 ? bcd & 0x0F : (bcd & 0xF0) >> 4));
         }
-        char n[14];
-        for (int i = 0; i < 7; i++) {
-            n[i * 2] = '0' + ((buf[i + 1] & 0xF0) >> 4);
-            n[i * 2 + 1] = '0' + (buf[i + 1] & 0x0F);
+        if (digits < pw) {
+            memset(cp, '0', pw - digits); // 仮数部の桁数を超える整数
+            cp += pw - digits;
         }
-        int pw = buf[0] & 0x7F;
-        fmt[0] = 0;
-        if (pw & 0x40) {
-            pw &= 0x3F;
-            switch (pw) {
-                case 14: strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c%c%c%c%c"); break;
-                case 13: strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c%c%c%c.%c"); break;
-                case 12: strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c%c%c.%c%c"); break;
-                case 11: strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c%c.%c%c%c"); break;
-                case 10: strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c.%c%c%c%c"); break;
-                case 9: strcpy(fmt, "%c%c%c%c%c%c%c%c%c.%c%c%c%c%c"); break;
-                case 8: strcpy(fmt, "%c%c%c%c%c%c%c%c.%c%c%c%c%c%c"); break;
-                case 7: strcpy(fmt, "%c%c%c%c%c%c%c.%c%c%c%c%c%c%c"); break;
-                case 6: strcpy(fmt, "%c%c%c%c%c%c.%c%c%c%c%c%c%c%c"); break;
-                case 5: strcpy(fmt, "%c%c%c%c%c.%c%c%c%c%c%c%c%c%c"); break;
-                case 4: strcpy(fmt, "%c%c%c%c.%c%c%c%c%c%c%c%c%c%c"); break;
-                case 3: strcpy(fmt, "%c%c%c.%c%c%c%c%c%c%c%c%c%c%c"); break;
-                case 2: strcpy(fmt, "%c%c.%c%c%c%c%c%c%c%c%c%c%c%c"); break;
-                case 1: strcpy(fmt, "%c.%c%c%c%c%c%c%c%c%c%c%c%c%c"); break;
-                case 0: strcpy(fmt, ".%c%c%c%c%c%c%c%c%c%c%c%c%c%c"); break;
-                default: {
-                    strcpy(fmt, "%c%c%c%c%c%c%c%c%c%c%c%c%c%c");
-                    for (; 14 < pw; pw--) {
-                        strcat(fmt, "0");
-                    }
-                }
-            }
-        } else {
-            pw ^= 0x3F;
-            strcpy(fmt, ".");
-            for (; 0 <= pw; pw--) {
-                strcat(fmt, "0");
-            }
-            strcat(fmt, "%c%c%c%c%c%c%c%c%c%c%c%c%c%c");
+        // 先頭の0と、小数点以下の末尾の0 (全て0なら小数点も) を除いた範囲を出力
+        const char* begin = work;
+        const char* end = cp;
+        while (begin < end && '0' == *begin) begin++;
+        const char* dot = (const char*)memchr(begin, '.', end - begin);
+        if (dot) {
+            while ('0' == end[-1]) end--;
+            if (end - 1 == dot) end--;
         }
-        snprintf(result, sizeof(result), fmt, n[0], n[1], n[2], n[3], n[4], n[5], n[6], n[7], n[8], n[9], n[10], n[11], n[12], n[13]);
-        trimnum(result);
-        return result;
+        memcpy(result, begin, end - begin);
+        return (int)(end - begin);
     }
 
-    void makeBcdFloat(char* fstr, unsigned char* buf, bool isDouble)
+    // 数字と小数点の列 (length バイト) を BCD浮動小数点数 (単精度: 4バイト, 倍精度: 8バイト) に変換
+    void makeBcdFloat(const char* str, size_t length, unsigned char* buf, bool isDouble)
     {
-        trimnum(fstr);
-        // fstr から小数点を削除した数字列 (mantissa) を作成
-        char mantissa[512];
-        strcpy(mantissa, fstr);
-        char* dot = strchr(mantissa, '.');
+        const int digits = isDouble ? 14 : 6;
+        // 先頭の0と、小数点以下の末尾の0 (全て0なら小数点も) を除く
+        const char* begin = str;
+        const char* end = str + length;
+        while (begin < end && '0' == *begin) begin++;
+        const char* dot = (const char*)memchr(begin, '.', end - begin);
         if (dot) {
-            memmove(dot, dot + 1, strlen(dot + 1) + 1);
-            // BCDを求める時のワーク用に 0 を付与
-            strcat(mantissa, isDouble ? "00000000000000" : "000000");
-        } else {
-            // 上限桁数未満の場合はBCDを求める時のワーク用に 0 を付与
-            for (int len = (int)strlen(mantissa); len < (isDouble ? 14 : 6); len++) {
-                memmove(mantissa + 1, mantissa, strlen(mantissa) + 1);
-                mantissa[0] = '0';
+            const char* cp = dot + 1;
+            while (cp < end && '0' == *cp) cp++;
+            if (cp == end) {
+                end = dot;
+                dot = nullptr;
+            } else {
+                while ('0' == end[-1]) end--;
             }
         }
-        // mantissaが0ならオール0を返す
-        if (0L == atol(mantissa)) {
-            for (int i = 0; i < (isDouble ? 8 : 4); i++) {
-                buf[i] = 0;
-            }
+        // 仮数部 (小数点を除いた数字列) の i 桁目
+        // 小数点がある場合は右側を、無い場合は上限桁数に満たない分の左側を 0 で埋める
+        const int count = (int)(end - begin) - (dot ? 1 : 0);
+        const int pad = dot || digits <= count ? 0 : digits - count;
+        auto mantissa = [&](int i) -> char {
+            i -= pad;
+            if (i < 0) return '0';
+            if (count <= i) return dot ? '0' : '\0';
+            return begin[dot && begin + i >= dot ? i + 1 : i];
+        };
+        // 仮数部が0ならオール0 (先頭から数字が続く範囲で判定)
+        bool zero = true;
+        for (int i = 0; zero && i < count + pad && isdigit(mantissa(i)); i++) {
+            zero = '0' == mantissa(i);
+        }
+        if (zero) {
+            memset(buf, 0, digits / 2 + 1);
             return;
         }
-        // 小数点の位置から指数部 (index) を算出
-        dot = strchr(fstr, '.');
+        // 小数点の位置から指数部を算出
+        int top = 0;
         if (!dot) {
             // 整数
-            buf[0] = 0x40 | (isDouble ? 14 : 6);
-        } else if (0 == atoi(fstr)) {
-            // 1未満の実数
+            buf[0] = 0x40 | digits;
+        } else if (0 == integerPart(begin)) {
+            // 1未満の実数 (先頭の0を詰めた分だけ指数を下げる)
             buf[0] = 0x40;
-            while ('0' == mantissa[0] && 0 != buf[0]) {
-                memmove(&mantissa[0], &mantissa[1], strlen(&mantissa[1]) + 1);
+            while ('0' == mantissa(top) && 0 != buf[0]) {
+                top++;
                 buf[0]--;
             }
         } else {
             // 1以上の実数
-            int index = (int)((dot ? dot : fstr) - fstr);
-            buf[0] = 0x40 | index;
-            buf[0] &= 0x7F;
+            buf[0] = (0x40 | (int)(dot - begin)) & 0x7F;
         }
-        // mantissaをBCD形式でメモリに設定
-        for (int i = 0; i < (isDouble ? 7 : 3); i++) {
-            buf[1 + i] = (mantissa[i * 2] - '0') << 4;
-            buf[1 + i] |= mantissa[i * 2 + 1] - '0';
+        // 仮数部をBCD形式で設定
+        for (int i = 0; i < digits / 2; i++) {
+            buf[1 + i] = (mantissa(top + i * 2) - '0') << 4;
+            buf[1 + i] |= mantissa(top + i * 2 + 1) - '0';
         }
     }
 
-    void trimnum(char* result)
+    // 先頭の数字列を atoi と同じ規則で int にした値 (long の上限で飽和させてから int に切り詰める)
+    int integerPart(const char* str)
     {
-        // 先頭の0をトリム
-        char* z = result;
-        while (*z == '0') z++;
-        if (z != result) {
-            memmove(result, z, strlen(z) + 1);
-        }
-        // 小数点以下が0なら小数点から削除
-        char* dot = strchr(result, '.');
-        if (dot) {
-            char* cp = dot;
-            for (++cp; *cp == '0'; cp++) {
-                ;
-            }
-            if (0 == *cp) {
-                *dot = 0;
-            }
-        }
-        // 小数点以下の末尾の0をトリム
-        dot = strchr(result, '.');
-        if (dot) {
-            for (dot += strlen(dot) - 1; *dot != '.' && *dot == '0'; dot--) {
-                *dot = 0;
+        unsigned long long value = 0;
+        for (; isdigit(*str); str++) {
+            int digit = *str - '0';
+            if (((unsigned long long)LONG_MAX - digit) / 10 < value) {
+                value = LONG_MAX;
+                for (; isdigit(*str); str++) {
+                    ;
+                }
+                break;
             }
+            value = value * 10 + digit;
         }
+        return (int)(long)value;
     }
 
     void trimstring(char* src)
@@ -645,29 +979,24 @@ class BasicFilter
         return value;
     }
 
-    struct StatementRecord* getStatementFromCode(unsigned int code)
+    const BasicTable::StatementRecord* getStatementFromWord(const char* src)
     {
-        for (int i = 1; stbl[i].code; i++) {
-            if (stbl[i].code == code) {
-                return &stbl[i];
+        // トライ木を1文字ずつ辿り、最後に見つかった (最長一致の) 予約語を返す
+        const BasicTable::Trie& trie = BasicTable::trie;
+        const BasicTable::StatementRecord* result = &BasicTable::stbl[0];
+        int c = toupper((unsigned char)*src);
+        if (c < 0x20 || 0x5F < c) return result;
+        for (int node = trie.root[c - 0x20]; node;) {
+            if (trie.node[node].record) {
+                result = &BasicTable::stbl[trie.node[node].record];
             }
-        }
-        return &stbl[0];
-    }
-
-    struct StatementRecord* getStatementFromWord(const char* src)
-    {
-        struct StatementRecord* result = &stbl[0];
-        size_t rl = 0;
-        for (int i = 1; stbl[i].code; i++) {
-            size_t wl = strlen(stbl[i].word);
-            if (0 == strncasecmp(src, stbl[i].word, wl)) {
-                if (rl < wl) {
-                    rl = wl;
-                    result = &stbl[i];
-                }
+            c = toupper((unsigned char)*++src);
+            for (node = c ? trie.node[node].child : 0; node && trie.node[node].ch != c;) {
+                node = trie.node[node].sibling;
             }
         }
         return result;
     }
-};
\ No newline at end of file
+};
+
+#endif // INCLUDE_BASIC_HPP
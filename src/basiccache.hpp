@@ -0,0 +1,174 @@
+/**
+ * SUZUKI PLAN - MSX-BASIC Tokenizer Cache
+ * Persistent content-addressed cache of the intermediate code
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_BASICCACHE_HPP
+#define INCLUDE_BASICCACHE_HPP
+#include "basic.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of the txt2bas results (file: DIR/VERSION-TABLE-HASH.bas)
+// - The key is the tokenizer version, the hash of the reserved word table and the 128-bit hash of the whole text
+// - A text that is not MSX-BASIC is cached as an empty file (written as a binary file)
+// - Entries are written to a temporary file and renamed, so concurrent processes and threads can share the directory
+class BasicCache
+{
+  public:
+    enum Result {
+        Miss,
+        NotBasic,  // txt2bas failed for the text
+        Converted, // *bas: intermediate code (free it)
+    };
+
+    // Use the directory as the cache (made if not exists)
+    bool setDirectory(const char* dir)
+    {
+        if (0 != mkdir(dir, 0755) && EEXIST != errno) return false;
+        struct stat st;
+        if (0 != stat(dir, &st) || !S_ISDIR(st.st_mode)) return false;
+        snprintf(this->dir, sizeof(this->dir), "%s", dir);
+        return true;
+    }
+
+    bool isEnabled() const { return 0 != dir[0]; }
+
+    // Convert the text with the filter unless the result is cached (same as filter.txt2bas)
+    unsigned char* txt2bas(BasicFilter& filter, const char* text, size_t size, size_t* basSize) const
+    {
+        if (!isEnabled()) return convert(filter, text, size, basSize);
+        char path[sizeof(dir) + 64];
+        makePath(text, size, path);
+        unsigned char* bas = nullptr;
+        switch (find(path, &bas, basSize)) {
+            case NotBasic: return nullptr;
+            case Converted: return bas;
+            case Miss: break;
+        }
+        bas = convert(filter, text, size, basSize);
+        store(path, bas, bas ? *basSize : 0);
+        return bas;
+    }
+
+    // 128-bit hash (two lanes of 64-bit multiply and rotate for each 8 bytes, then finalized with fmix64)
+    static void hash(const void* data, size_t size, unsigned long long result[2])
+    {
+        const unsigned long long k1 = 0x87C37B91114253D5ULL;
+        const unsigned long long k2 = 0x4CF5AD432745937FULL;
+        const unsigned char* p = (const unsigned char*)data;
+        unsigned long long h1 = 0x9E3779B97F4A7C15ULL ^ size;
+        unsigned long long h2 = 0xC2B2AE3D27D4EB4FULL ^ size;
+        for (size_t n = size / 8; n; n--, p += 8) {
+            unsigned long long v;
+            memcpy(&v, p, 8);
+            h1 = rotl(h1 ^ rotl(v * k1, 31) * k2, 27) * 5 + 0x52DCE729;
+            h2 = rotl(h2 ^ rotl(v * k2, 33) * k1, 31) * 5 + 0x38495AB5 + h1;
+        }
+        unsigned long long tail = 0;
+        memcpy(&tail, p, size & 7);
+        h1 ^= rotl(tail * k1, 31) * k2;
+        h2 ^= rotl(tail * k2, 33) * k1;
+        h1 += h2;
+        h2 += h1;
+        h1 = fmix(h1);
+        h2 = fmix(h2);
+        result[0] = h1 + h2;
+        result[1] = h2 + result[0];
+    }
+
+  private:
+    char dir[4096] = {0};
+
+    static unsigned long long rotl(unsigned long long v, int n) { return (v << n) | (v >> (64 - n)); }
+
+    static unsigned long long fmix(unsigned long long v)
+    {
+        v ^= v >> 33;
+        v *= 0xFF51AFD7ED558CCDULL;
+        v ^= v >> 33;
+        v *= 0xC4CEB9FE1A85EC53ULL;
+        v ^= v >> 33;
+        return v;
+    }
+
+    static unsigned char* convert(BasicFilter& filter, const char* text, size_t size, size_t* basSize)
+    {
+        BasicBufferSource source(text, size);
+        BasicMemorySink sink;
+        if (!filter.txt2bas(source, sink)) return nullptr;
+        return (unsigned char*)sink.release(basSize);
+    }
+
+    void makePath(const char* text, size_t size, char* path) const
+    {
+        unsigned long long h[2];
+        hash(text, size, h);
+        sprintf(path, "%s/%d-%08x-%016llx%016llx.bas", dir, BasicFilter::tokenizerVersion, BasicTable::tableHash, h[0], h[1]);
+    }
+
+    Result find(const char* path, unsigned char** bas, size_t* basSize) const
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) return Miss;
+        struct stat st;
+        Result result = Miss;
+        if (0 == fstat(fd, &st)) {
+            if (0 == st.st_size) {
+                result = NotBasic;
+            } else if ((*bas = (unsigned char*)malloc(st.st_size))) {
+                if (st.st_size == read(fd, *bas, st.st_size)) {
+                    *basSize = (size_t)st.st_size;
+                    result = Converted;
+                } else {
+                    free(*bas);
+                    *bas = nullptr;
+                }
+            }
+        }
+        close(fd);
+        return result;
+    }
+
+    // Write the result to the cache (a failure is ignored, the caller uses the result anyway)
+    void store(const char* path, const unsigned char* bas, size_t basSize) const
+    {
+        char tmp[sizeof(dir) + 64];
+        snprintf(tmp, sizeof(tmp), "%s/.tmp-XXXXXX", dir);
+        int fd = mkstemp(tmp);
+        if (fd < 0) return;
+        bool result = 0 == basSize || (ssize_t)basSize == write(fd, bas, basSize);
+        fchmod(fd, 0644);
+        result = 0 == close(fd) && result;
+        if (!result || 0 != rename(tmp, path)) unlink(tmp);
+    }
+};
+
+#endif // INCLUDE_BASICCACHE_HPP
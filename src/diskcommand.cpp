@@ -0,0 +1,303 @@
+/**
+ * SUZUKI PLAN - MSX Disk Manager for CLI
+ * Commands for the disk image (shared by dskmgr and the benchmark)
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#include "diskcommand.hpp"
+#include "basic.hpp"
+#include "basiccache.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+namespace DiskCommand
+{
+int diskError(const DiskImage* disk, int code)
+{
+    puts(disk->getErrorMessage());
+    return code;
+}
+
+int diskWriteError(const DiskImage* disk)
+{
+    return diskError(disk, DiskImage::InvalidPath == disk->getError() ? 4 : -1);
+}
+
+const char* getFileName(const char* path)
+{
+    const char* cp = strrchr(path, '/');
+    if (!cp) cp = strrchr(path, '\\');
+    return cp ? cp + 1 : path;
+}
+
+bool isBasicFileName(const char* path)
+{
+    const char* ext = strchr(getFileName(path), '.');
+    return ext && 0 == strcasecmp(ext + 1, "BAS");
+}
+
+int info(DiskImage* disk)
+{
+    const DiskImage::BootSector& boot = disk->getBootSector();
+    const DiskImage::Directory* dir = disk->getRootDirectory();
+    puts("[Boot Sector]");
+    printf("            OEM: %s\n", boot.oemName);
+    printf("       Media ID: 0x%02X\n", boot.mediaId);
+    printf("    Sector Size: %d bytes\n", boot.sectorSize);
+    printf("  Total Sectors: %d\n", boot.numberOfSector);
+    printf("   Cluster Size: %d bytes (%d sectors)\n", boot.clusterSize * boot.sectorSize, boot.clusterSize);
+    printf("   FAT Position: %d\n", boot.fatPosition);
+    printf("       FAT Size: %d bytes (%d sectors)\n", boot.fatSize * boot.sectorSize, boot.fatSize);
+    printf("       FAT Copy: %d\n", boot.fatCopy);
+    printf("Creatable Files: %d\n", boot.directoryEntry);
+    printf("        Sectors: %d per track\n", boot.sectorPerTrack);
+    printf("     Disk Sides: %d\n", boot.diskSides);
+    printf(" Hidden Sectors: %d\n", boot.hiddenSector);
+    if (0 == memcmp(boot.idLabel, "VOL_ID", 6)) {
+        printf("      Volume ID: %02X,%02X,%02X,%02X\n", boot.idValue[0], boot.idValue[1], boot.idValue[2], boot.idValue[3]);
+    }
+    printf("     Dirty Flag: %02X\n", boot.dirtyFlag);
+    puts("\n[FAT]");
+    printf("Fat ID: 0x%02X\n", disk->getFatId());
+    int usingCluster = 1;
+    for (int i = 0; i < dir->entryCount; i++) {
+        if (!dir->entries[i].removed) {
+            printf("- dirent#%d (%s) ... %d", i, dir->entries[i].displayName, dir->entries[i].cluster);
+            usingCluster++;
+            int c = disk->isChainCluster(dir->entries[i].cluster) ? disk->getFatEntry(dir->entries[i].cluster) : 0;
+            for (int n = 0; disk->isChainCluster(c) && n < disk->getMaxCluster(); n++) {
+                printf(",%d", c);
+                usingCluster++;
+                c = disk->getFatEntry(c);
+            }
+            printf("\n");
+        }
+    }
+    printf("Total using cluster: %d (%d bytes)\n", usingCluster, usingCluster * disk->getClusterBytes());
+    return 0;
+}
+
+void printDirectory(FILE* fp, const DiskImage* disk, const DiskImage::Directory* d)
+{
+    const DiskImage::BootSector& boot = disk->getBootSector();
+    int totalSize = 0;
+    int totalCluster = 0;
+    int fileCount = 0;
+    int cs = disk->getClusterBytes();
+    for (int i = 0; i < d->entryCount; i++) {
+        const DiskImage::Entry* e = &d->entries[i];
+        if (e->removed) continue;
+        fprintf(fp, "%02X:%c%c%c%c%c  %-12s  %8u bytes  %4d.%02d.%02d %02d:%02d:%02d  (C:%d, S:%d)\n", e->attr.raw, e->attr.dirent ? 'd' : '-', e->attr.volumeLabel ? 'v' : '-', e->attr.systemFile ? 's' : '-', e->attr.hidden ? 'h' : '-', e->attr.readOnly ? '-' : 'w', e->displayName, e->size, e->date.year, e->date.month, e->date.day, e->date.hour, e->date.minute, e->date.second, e->cluster, boot.dataPosition + (e->cluster - 2) * boot.clusterSize);
+        totalSize += e->size;
+        totalCluster += e->size / cs + (e->size % cs ? 1 : 0);
+        fileCount++;
+    }
+    if (0 < fileCount) {
+        int freeCluster = disk->countFreeCluster();
+        fprintf(fp, "Total Size: %7d bytes\n", totalSize);
+        fprintf(fp, " Free Size: %7d bytes (%d clusters)\n", cs * freeCluster, freeCluster);
+    }
+}
+
+int ls(DiskImage* disk, const char* path)
+{
+    const DiskImage::Directory* d = disk->openDirectory(path);
+    if (!d) return diskError(disk, 4);
+    printDirectory(stdout, disk, d);
+    return 0;
+}
+
+int get(DiskImage* disk, const char* path, const char* getAs)
+{
+    const DiskImage::Entry* e = disk->findFile(path);
+    if (!e) return diskError(disk, 4);
+    FILE* fp = fopen(getAs ? getAs : getFileName(path), "wb");
+    if (!fp) {
+        puts("I/O error");
+        return 6;
+    }
+    bool result = disk->read(e, fp);
+    if (0 != fclose(fp) && result) {
+        puts("I/O error");
+        return 6;
+    }
+    return result ? 0 : diskError(disk, 6);
+}
+
+int cat(DiskImage* disk, const char* path)
+{
+    const DiskImage::Entry* e = disk->findFile(path);
+    if (!e) return diskError(disk, 4);
+    if (0 == strncmp(e->ext, "BAS", 3)) {
+        unsigned char* buf = (unsigned char*)malloc(e->size);
+        if (!buf) {
+            puts("No memory");
+            return 6;
+        }
+        bool result = disk->read(e, buf);
+        if (result) {
+            BasicFilter filter;
+            filter.bas2txt(stdout, buf);
+        }
+        free(buf);
+        if (!result) return diskError(disk, 6);
+    } else if (!disk->read(e, stdout)) {
+        return diskError(disk, 6);
+    }
+    return 0;
+}
+
+void loadLocalFile(LocalFile* file, const BasicCache* cache)
+{
+    BasicFilter filter;
+    FILE* fp = fopen(file->path, "rb");
+    if (!fp) {
+        file->error = 1;
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    if (size < 1) {
+        file->error = 2;
+        fclose(fp);
+        return;
+    }
+    fseek(fp, 0, SEEK_SET);
+    file->sourceSize = (size_t)size;
+    bool basic = isBasicFileName(file->path);
+    if (basic && !(cache && cache->isEnabled())) {
+        // キャッシュを使わない場合はファイル全体を読み込まずに一定サイズずつ変換する
+        BasicFileSource source(fp);
+        BasicMemorySink sink;
+        if (filter.txt2bas(source, sink)) {
+            fclose(fp);
+            file->data = (unsigned char*)sink.release(&file->size);
+            file->converted = true;
+            if (!file->data) file->error = 3;
+            return;
+        }
+        // テキスト形式でない場合はバイナリとして読み直す
+        clearerr(fp);
+        fseek(fp, 0, SEEK_SET);
+        basic = false;
+    }
+    unsigned char* bin = (unsigned char*)malloc(size + 1);
+    if (!bin) {
+        file->error = 3;
+        fclose(fp);
+        return;
+    }
+    bin[size] = 0;
+    if ((size_t)size != fread(bin, 1, size, fp)) {
+        file->error = 2;
+        free(bin);
+        fclose(fp);
+        return;
+    }
+    fclose(fp);
+    file->data = bin;
+    file->size = (size_t)size;
+    if (basic) {
+        size_t basSize = 0;
+        unsigned char* bas = cache->txt2bas(filter, (char*)bin, (size_t)size, &basSize);
+        if (bas) {
+            free(bin);
+            file->data = bas;
+            file->size = basSize;
+            file->converted = true;
+        }
+    }
+}
+
+void makeShortName(const char* fileName, char* result)
+{
+    const char* ext = strchr(fileName, '.');
+    int nameLen = ext ? (int)(ext - fileName) : (int)strlen(fileName);
+    snprintf(result, 13, "%.*s", nameLen < 8 ? nameLen : 8, fileName);
+    if (ext && ext[1]) {
+        strcat(result, ".");
+        strncat(result, ext + 1, 3);
+    }
+}
+
+bool writeLocalFile(DiskImage* disk, const LocalFile* file, const char* target, const char* putAs, const unsigned char* date)
+{
+    switch (file->error) {
+        case 1: printf("File not found: %s\n", file->path); return false;
+        case 2: puts("I/O error"); return false;
+        case 3: puts("No memory"); return false;
+    }
+    if (file->converted) {
+        printf("%s: Convert to MSX-BASIC intermediate code ... %d -> %lu bytes", file->path, (int)file->sourceSize, file->size);
+    } else {
+        printf("%s: Write to disk as a binary file ... %d bytes", file->path, (int)file->size);
+    }
+    if (putAs) {
+        printf(" as %s\n", putAs);
+    } else {
+        printf("\n");
+    }
+    if (!disk->write(target, file->data, file->size, date)) {
+        puts(disk->getErrorMessage());
+        return false;
+    }
+    return true;
+}
+
+int put(DiskImage* disk, const char* path, const char* putAs, const BasicCache* cache)
+{
+    const char* fileName = getFileName(path);
+    char target[4096];
+    if (sizeof(target) <= strlen(putAs ? putAs : fileName) + strlen(fileName)) {
+        puts("File not found (invalid length)");
+        return 4;
+    }
+    strcpy(target, putAs ? putAs : fileName);
+    const char* displayName = getFileName(target);
+    if (!*displayName) {
+        // as DIR/ の場合はローカルのファイル名で書き込む
+        strcat(target, fileName);
+    }
+    LocalFile file;
+    memset(&file, 0, sizeof(file));
+    file.path = path;
+    loadLocalFile(&file, cache);
+    bool result = writeLocalFile(disk, &file, target, putAs ? displayName : nullptr);
+    free(file.data);
+    if (!result) return 0 == file.error && DiskImage::InvalidPath == disk->getError() ? 4 : -1;
+    return 0;
+}
+
+int makeDirectory(DiskImage* disk, const char* path)
+{
+    return disk->makeDirectory(path) ? 0 : diskWriteError(disk);
+}
+
+int rm(DiskImage* disk, const char* path)
+{
+    return disk->remove(path) ? 0 : diskWriteError(disk);
+}
+} // namespace DiskCommand
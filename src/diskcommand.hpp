@@ -0,0 +1,83 @@
+/**
+ * SUZUKI PLAN - MSX Disk Manager for CLI
+ * Commands for the disk image (shared by dskmgr and the benchmark)
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_DISKCOMMAND_HPP
+#define INCLUDE_DISKCOMMAND_HPP
+#include "diskimage.hpp"
+#include <stdio.h>
+
+class BasicCache;
+
+// Commands of dskmgr for an opened disk image (libdskmgr.a)
+// - Messages are printed to stdout, and the exit code of the command is returned (0: success)
+// - Modifications are not flushed (the caller flushes the image)
+namespace DiskCommand
+{
+// Local file loaded (and tokenized if the name is *.BAS) to be written to the disk
+struct LocalFile {
+    const char* path;
+    unsigned char* data;
+    size_t size;       // bytes of data (after conversion)
+    size_t sourceSize; // bytes of the local file
+    bool converted;    // converted to MSX-BASIC intermediate code
+    int error;         // 0: success, 1: file not found, 2: I/O error, 3: no memory
+};
+
+// Print the reason of the last failed disk operation and return the exit code
+int diskError(const DiskImage* disk, int code);
+
+// Exit code of put, rm and mkdir (4: invalid path, -1: others)
+int diskWriteError(const DiskImage* disk);
+
+// Last element of the path (local file name)
+const char* getFileName(const char* path);
+
+// MSX-BASIC file (.BAS) to be converted between the text and the intermediate code
+bool isBasicFileName(const char* path);
+
+// 8.3 name of the local file name (the name and the extension are truncated)
+void makeShortName(const char* fileName, char* result);
+
+// Read (and tokenize) the local file (thread safe: does not touch the disk image and stdout, cache: nullptr for none)
+void loadLocalFile(LocalFile* file, const BasicCache* cache);
+
+// Write the loaded file to the target path of the disk
+bool writeLocalFile(DiskImage* disk, const LocalFile* file, const char* target, const char* putAs, const unsigned char* date = nullptr);
+
+// Print the file list of the directory
+void printDirectory(FILE* fp, const DiskImage* disk, const DiskImage::Directory* d);
+
+int info(DiskImage* disk);
+int ls(DiskImage* disk, const char* path);
+int get(DiskImage* disk, const char* path, const char* getAs);
+int cat(DiskImage* disk, const char* path);
+int put(DiskImage* disk, const char* path, const char* putAs, const BasicCache* cache);
+int rm(DiskImage* disk, const char* path);
+int makeDirectory(DiskImage* disk, const char* path);
+} // namespace DiskCommand
+
+#endif // INCLUDE_DISKCOMMAND_HPP
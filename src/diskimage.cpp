@@ -0,0 +1,1280 @@
+/**
+ * SUZUKI PLAN - MSX Disk Image
+ * Read and write of the MSX-DOS (FAT12) disk image
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#include "diskimage.hpp"
+#include "fat12.hpp"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const DiskImage::Format DiskImage::formats[] = {
+    {"1DD", 720, 2, 2, 112, 0xF8, 9, 1},   // 360KB
+    {"2DD", 1440, 2, 3, 112, 0xF9, 9, 2},  // 720KB (default)
+    {"2HD", 2880, 1, 9, 224, 0xF0, 18, 2}, // 1.44MB
+    {nullptr, 0, 0, 0, 0, 0, 0, 0}};
+
+static const unsigned char dos1BootProgram[0x1D0] = {
+    0xd0,                   // ret     nc                              ;[0030] d0
+    0xed, 0x53, 0x6a, 0xc0, // ld      ($c06a),de                      ;[0031] ed 53 6a c0
+    0x32, 0x72, 0xc0,       // ld      ($c072),a                       ;[0035] 32 72 c0
+    0x36, 0x67,             // ld      (hl),$67                        ;[0038] 36 67
+    0x23,                   // inc     hl                              ;[003a] 23
+    0x36, 0xc0,             // ld      (hl),$c0                        ;[003b] 36 c0
+    0x31, 0x1f, 0xf5,       // ld      sp,$f51f                        ;[003d] 31 1f f5
+    0x11, 0xab, 0xc0,       // ld      de,$c0ab                        ;[0040] 11 ab c0
+    0x0e, 0x0f,             // ld      c,$0f                           ;[0043] 0e 0f
+    0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0045] cd 7d f3
+    0x3c,                   // inc     a                               ;[0048] 3c
+    0x28, 0x26,             // jr      z,$0071                         ;[0049] 28 26
+    0x11, 0x00, 0x01,       // ld      de,$0100                        ;[004b] 11 00 01
+    0x0e, 0x1a,             // ld      c,$1a                           ;[004e] 0e 1a
+    0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0050] cd 7d f3
+    0x21, 0x01, 0x00,       // ld      hl,$0001                        ;[0053] 21 01 00
+    0x22, 0xb9, 0xc0,       // ld      ($c0b9),hl                      ;[0056] 22 b9 c0
+    0x21, 0x00, 0x3f,       // ld      hl,$3f00                        ;[0059] 21 00 3f
+    0x11, 0xab, 0xc0,       // ld      de,$c0ab                        ;[005c] 11 ab c0
+    0x0e, 0x27,             // ld      c,$27                           ;[005f] 0e 27
+    0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0061] cd 7d f3
+    0xc3, 0x00, 0x01,       // jp      $0100                           ;[0064] c3 00 01
+    0x69,                   // ld      l,c                             ;[0067] 69
+    0xc0,                   // ret     nz                              ;[0068] c0
+    0xcd, 0x00, 0x00,       // call    $0000                           ;[0069] cd 00 00
+    0x79,                   // ld      a,c                             ;[006c] 79
+    0xe6, 0xfe,             // and     $fe                             ;[006d] e6 fe
+    0xd6, 0x02,             // sub     $02                             ;[006f] d6 02
+    0xf6, 0x00,             // or      $00                             ;[0071] f6 00
+    0xca, 0x22, 0x40,       // jp      z,$4022                         ;[0073] ca 22 40
+    0x11, 0x85, 0xc0,       // ld      de,$c085                        ;[0076] 11 85 c0
+    0x0e, 0x09,             // ld      c,$09                           ;[0079] 0e 09
+    0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[007b] cd 7d f3
+    0x0e, 0x07,             // ld      c,$07                           ;[007e] 0e 07
+    0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0080] cd 7d f3
+    0x18, 0xb8,             // jr      $003d                           ;[0083] 18 b8
+    // 以下データ
+    0x42, 0x6F, 0x6F, 0x74, 0x20, 0x65, 0x72, 0x72, // Boot err
+    0x6F, 0x72, 0x0D, 0x0A, 0x50, 0x72, 0x65, 0x73, // or..Pres
+    0x73, 0x20, 0x61, 0x6E, 0x79, 0x20, 0x6B, 0x65, // s any ke
+    0x79, 0x20, 0x66, 0x6F, 0x72, 0x20, 0x72, 0x65, // y for re
+    0x74, 0x72, 0x79, 0x0D, 0x0A, 0x24, 0x00, 0x4D, // try..$.M
+    0x53, 0x58, 0x44, 0x4F, 0x53, 0x20, 0x20, 0x53, // SXDOS  S
+    0x59, 0x53,                                     // YS
+};
+static const unsigned char dos2BootProgram[0x1D0] = {
+    0xC0, 0x0E, 0x0F, 0xCD, 0x7D, 0xF3, 0x3C, 0xCA, 0x63, 0xC0, 0x11, 0x00, 0x01, 0x0E, 0x1A, 0xCD,
+    0x7D, 0xF3, 0x21, 0x01, 0x00, 0x22, 0xB9, 0xC0, 0x21, 0x00, 0x3F, 0x11, 0xAB, 0xC0, 0x0E, 0x27,
+    0xCD, 0x7D, 0xF3, 0xC3, 0x00, 0x01, 0x58, 0xC0, 0xCD, 0x00, 0x00, 0x79, 0xE6, 0xFE, 0xFE, 0x02,
+    0xC2, 0x6A, 0xC0, 0x3A, 0xD0, 0xC0, 0xA7, 0xCA, 0x22, 0x40, 0x11, 0x85, 0xC0, 0xCD, 0x77, 0xC0,
+    0x0E, 0x07, 0xCD, 0x7D, 0xF3, 0x18, 0xB4, 0x1A, 0xB7, 0xC8, 0xD5, 0x5F, 0x0E, 0x06, 0xCD, 0x7D,
+    0xF3, 0xD1, 0x13, 0x18, 0xF2, 0x42, 0x6F, 0x6F, 0x74, 0x20, 0x65, 0x72, 0x72, 0x6F, 0x72, 0x0D,
+    0x0A, 0x50, 0x72, 0x65, 0x73, 0x73, 0x20, 0x61, 0x6E, 0x79, 0x20, 0x6B, 0x65, 0x79, 0x20, 0x66,
+    0x6F, 0x72, 0x20, 0x72, 0x65, 0x74, 0x72, 0x79, 0x0D, 0x0A, 0x00, 0x00, 0x4D, 0x53, 0x58, 0x44,
+    0x4F, 0x53, 0x20, 0x20, 0x53, 0x59, 0x53, 0x00};
+
+
+static DiskImage::NameKey makeNameKey(const char* name, const char* ext)
+{
+    unsigned char buf[11];
+    for (int i = 0; i < 8; i++) buf[i] = toupper(name[i]);
+    for (int i = 0; i < 3; i++) buf[8 + i] = toupper(ext[i]);
+    DiskImage::NameKey key = {0, 0};
+    memcpy(&key.name, buf, 8);
+    memcpy(&key.ext, &buf[8], 3);
+    return key;
+}
+
+static unsigned int hashNameKey(const DiskImage::NameKey& key)
+{
+    unsigned long long h = (key.name ^ ((unsigned long long)key.ext << 21)) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+static void extractDirectoryEntry(DiskImage::Entry* entry, const unsigned char* ptr)
+{
+    memset(entry, 0, sizeof(DiskImage::Entry));
+    if (0xE5 == *ptr) {
+        entry->removed = true;
+        return;
+    }
+    entry->removed = false;
+    memcpy(entry->name, ptr, 8);
+    ptr += 8;
+    memcpy(entry->ext, ptr, 3);
+    ptr += 3;
+    entry->attr.raw = *ptr;
+    entry->attr.dirent = (*ptr) & 0b00010000 ? true : false;
+    entry->attr.volumeLabel = (*ptr) & 0b00001000 ? true : false;
+    entry->attr.systemFile = (*ptr) & 0b00000100 ? true : false;
+    entry->attr.hidden = (*ptr) & 0b00000010 ? true : false;
+    entry->attr.readOnly = (*ptr) & 0b00000001 ? true : false;
+    ptr += 11;
+    memcpy(entry->dateRaw, ptr, 4);
+    entry->date.minute = ((*ptr) & 0b11100000) >> 5;
+    entry->date.second = ((*ptr) & 0b00011111) << 1;
+    ptr++;
+    entry->date.hour = ((*ptr) & 0b11111000) >> 3;
+    entry->date.minute += ((*ptr) & 0b00000111) << 3;
+    ptr++;
+    entry->date.month = ((*ptr) & 0b11100000) >> 5;
+    entry->date.day = (*ptr) & 0b00011111;
+    ptr++;
+    entry->date.year = 1980 + (((*ptr) & 0b11111110) >> 1);
+    entry->date.month += ((*ptr) & 0b00000001) << 3;
+    ptr++;
+    memcpy(&entry->cluster, ptr, 2);
+    ptr += 2;
+    memcpy(&entry->size, ptr, 4);
+    ptr += 4;
+    strcpy(entry->displayName, entry->name);
+    for (int i = strlen(entry->displayName) - 1; 0 <= i; i--) {
+        if (' ' == entry->displayName[i]) {
+            entry->displayName[i] = 0;
+        } else
+            break;
+    }
+    if (entry->ext[0] != 0 && entry->ext[1] != ' ') {
+        strcat(entry->displayName, ".");
+        strcat(entry->displayName, entry->ext);
+    }
+    entry->key = makeNameKey(entry->name, entry->ext);
+}
+
+bool DiskImage::parseFormat(const char* str, Format* result)
+{
+    for (int i = 0; formats[i].name; i++) {
+        if (0 == strcasecmp(str, formats[i].name)) {
+            *result = formats[i];
+            return true;
+        }
+    }
+    // custom: SECTORS,CLUSTER,DIRENT[,MEDIA]
+    unsigned int sectors = 0, cluster = 0, dirent = 0, media = 0xF9;
+    if (sscanf(str, "%u,%u,%u,%x", &sectors, &cluster, &dirent, &media) < 3) return false;
+    if (sectors < 16 || 65535 < sectors || cluster < 1 || 128 < cluster || (cluster & (cluster - 1)) || dirent < 16 || 4096 < dirent || media < 0xF0 || 0xFF < media) return false;
+    memset(result, 0, sizeof(Format));
+    result->name = "custom";
+    result->numberOfSector = (unsigned short)sectors;
+    result->clusterSize = (unsigned char)cluster;
+    result->directoryEntry = (unsigned short)((dirent + 15) / 16 * 16);
+    result->mediaId = (unsigned char)media;
+    result->sectorPerTrack = 9;
+    result->diskSides = 2;
+    // データ領域のクラスタ数をFAT12で表現できる最小のFATサイズを求める
+    int dirSectors = result->directoryEntry * 32 / 512;
+    for (result->fatSize = 1;; result->fatSize++) {
+        int dataSectors = (int)sectors - 1 - result->fatSize * 2 - dirSectors;
+        if (dataSectors < (int)cluster) return false;
+        int clusters = dataSectors / cluster;
+        if (4084 < clusters) return false;
+        if ((clusters + 2) * 3 / 2 + 1 <= result->fatSize * 512) break;
+    }
+    return true;
+}
+
+void DiskImage::getDate(unsigned char* date)
+{
+    makeDate(time(nullptr), date);
+}
+
+void DiskImage::makeDate(time_t t1, unsigned char* date)
+{
+    struct tm t2;
+    localtime_r(&t1, &t2);
+    date[0] = (t2.tm_min & 0b00000111) << 5;
+    date[0] |= (t2.tm_sec & 0b00111110) >> 1;
+    date[1] = (t2.tm_hour & 0b00011111) << 3;
+    date[1] |= (t2.tm_min & 0b00111000) >> 3;
+    date[2] = ((t2.tm_mon + 1) & 0b00000111) << 5;
+    date[2] |= (t2.tm_mday) & 0b00011111;
+    date[3] = ((t2.tm_year - 80) & 0b01111111) << 1;
+    date[3] |= ((t2.tm_mon + 1) & 0b00001000) >> 3;
+}
+
+DiskImage::DiskImage()
+{
+    image = nullptr;
+    path = nullptr;
+    memset(&imageFile, 0, sizeof(imageFile));
+    imageFile.fd = -1;
+    memset(&boot, 0, sizeof(boot));
+    memset(&fat, 0, sizeof(fat));
+    memset(&dir, 0, sizeof(dir));
+    dirCache = nullptr;
+    dirCacheSize = 0;
+    error = NoError;
+    errorMessage = "";
+}
+
+DiskImage::~DiskImage()
+{
+    close();
+}
+
+bool DiskImage::fail(Error error, const char* message)
+{
+    this->error = error;
+    errorMessage = message;
+    return false;
+}
+
+void DiskImage::markDirty(const void* ptr, size_t size)
+{
+    if (size < 1) return;
+    size_t ofs = (const unsigned char*)ptr - image[0];
+    for (size_t sector = ofs / 512; sector <= (ofs + size - 1) / 512; sector++) {
+        imageFile.dirty[sector / 8] |= 1 << (sector & 7);
+    }
+}
+
+bool DiskImage::isDirty(int sector) const
+{
+    return imageFile.dirty[sector / 8] & (1 << (sector & 7)) ? true : false;
+}
+
+bool DiskImage::isModified() const
+{
+    for (int i = 0; imageFile.dirty && i < (imageFile.sectorCount + 7) / 8; i++) {
+        if (imageFile.dirty[i]) return true;
+    }
+    return false;
+}
+
+bool DiskImage::allocateDirtyMap(int sectorCount)
+{
+    imageFile.sectorCount = sectorCount;
+    imageFile.dirty = (unsigned char*)calloc(1, (sectorCount + 7) / 8);
+    return imageFile.dirty ? true : fail(NoMemory, "No memory");
+}
+
+bool DiskImage::setPath(const char* path)
+{
+    free(this->path);
+    this->path = strdup(path);
+    return this->path ? true : fail(NoMemory, "No memory");
+}
+
+void DiskImage::extractBootSectorFromDisk()
+{
+    memset(&boot, 0, sizeof(boot));
+    memcpy(&boot.bootJump, &image[0][0x00], 3);
+    memcpy(&boot.oemName, &image[0][0x03], 8);
+    memcpy(&boot.sectorSize, &image[0][0xB], 2);
+    memcpy(&boot.clusterSize, &image[0][0xD], 1);
+    memcpy(&boot.fatPosition, &image[0][0xE], 2);
+    memcpy(&boot.fatCopy, &image[0][0x10], 1);
+    memcpy(&boot.directoryEntry, &image[0][0x11], 2);
+    memcpy(&boot.numberOfSector, &image[0][0x13], 2);
+    memcpy(&boot.mediaId, &image[0][0x15], 1);
+    memcpy(&boot.fatSize, &image[0][0x16], 2);
+    memcpy(&boot.sectorPerTrack, &image[0][0x18], 2);
+    memcpy(&boot.diskSides, &image[0][0x1A], 2);
+    memcpy(&boot.hiddenSector, &image[0][0x1C], 2);
+    memcpy(&boot.bootJump2, &image[0][0x1E], 2);
+    memcpy(&boot.idLabel, &image[0][0x20], 6);
+    memcpy(&boot.dirtyFlag, &image[0][0x26], 1);
+    memcpy(&boot.idValue, &image[0][0x27], 4);
+    memcpy(&boot.reserved, &image[0][0x2B], 5);
+    memcpy(&boot.bootProgram, &image[0][0x30], sizeof(boot.bootProgram));
+    boot.directoryPosition = boot.fatPosition + boot.fatSize * boot.fatCopy;
+    boot.dataPosition = boot.directoryPosition + (boot.directoryEntry * 32 + 511) / 512;
+}
+
+void DiskImage::extractBootSectorToDisk()
+{
+    memcpy(&image[0][0x00], &boot.bootJump, 3);
+    memcpy(&image[0][0x03], &boot.oemName, 8);
+    memcpy(&image[0][0xB], &boot.sectorSize, 2);
+    memcpy(&image[0][0xD], &boot.clusterSize, 1);
+    memcpy(&image[0][0xE], &boot.fatPosition, 2);
+    memcpy(&image[0][0x10], &boot.fatCopy, 1);
+    memcpy(&image[0][0x11], &boot.directoryEntry, 2);
+    memcpy(&image[0][0x13], &boot.numberOfSector, 2);
+    memcpy(&image[0][0x15], &boot.mediaId, 1);
+    memcpy(&image[0][0x16], &boot.fatSize, 2);
+    memcpy(&image[0][0x18], &boot.sectorPerTrack, 2);
+    memcpy(&image[0][0x1A], &boot.diskSides, 2);
+    memcpy(&image[0][0x1C], &boot.hiddenSector, 2);
+    memcpy(&image[0][0x1E], &boot.bootJump2, 2);
+    memcpy(&image[0][0x20], &boot.idLabel, 6);
+    memcpy(&image[0][0x26], &boot.dirtyFlag, 1);
+    memcpy(&image[0][0x27], &boot.idValue, 4);
+    memcpy(&image[0][0x2B], &boot.reserved, 5);
+    memcpy(&image[0][0x30], &boot.bootProgram, 0x1D0);
+    markDirty(image[0], 512);
+    boot.directoryPosition = boot.fatPosition + boot.fatSize * boot.fatCopy;
+    boot.dataPosition = boot.directoryPosition + (boot.directoryEntry * 32 + 511) / 512;
+}
+
+void DiskImage::setupBootSector(const Format* format)
+{
+    memset(&boot, 0, sizeof(boot));
+    boot.sectorSize = 512;
+    boot.clusterSize = format->clusterSize;
+    boot.fatPosition = 1;
+    boot.fatCopy = 2;
+    boot.directoryEntry = format->directoryEntry;
+    boot.numberOfSector = format->numberOfSector;
+    boot.mediaId = format->mediaId;
+    boot.fatSize = format->fatSize;
+    boot.sectorPerTrack = format->sectorPerTrack;
+    boot.diskSides = format->diskSides;
+    boot.hiddenSector = 0;
+    boot.directoryPosition = boot.fatPosition + boot.fatSize * boot.fatCopy;
+    boot.dataPosition = boot.directoryPosition + (boot.directoryEntry * 32 + 511) / 512;
+}
+
+bool DiskImage::isValidBootSector(size_t size) const
+{
+    if (512 != boot.sectorSize || 0 == boot.clusterSize || (boot.clusterSize & (boot.clusterSize - 1))) return false;
+    if (0 == boot.fatPosition || 0 == boot.fatCopy || 0 == boot.fatSize || 0 == boot.directoryEntry) return false;
+    if ((size_t)boot.numberOfSector * boot.sectorSize != size) return false;
+    return boot.dataPosition + boot.clusterSize <= boot.numberOfSector;
+}
+
+bool DiskImage::extractFatFromDisk()
+{
+    free(fat.next);
+    memset(&fat, 0, sizeof(fat));
+    const unsigned char* ptr = image[boot.fatPosition];
+    fat.fatId = ptr[0];
+    // データ領域のクラスタ数とFAT12に格納可能なエントリ数の小さい方
+    fat.clusterCount = (boot.numberOfSector - boot.dataPosition) / boot.clusterSize + 2;
+    int fatEntries = boot.fatSize * boot.sectorSize * 2 / 3;
+    if (fatEntries < fat.clusterCount) fat.clusterCount = fatEntries;
+    fat.next = (unsigned short*)malloc(fat.clusterCount * sizeof(unsigned short));
+    if (!fat.next) return fail(NoMemory, "No memory");
+    FAT12::decode(ptr, fat.next, fat.clusterCount);
+    return true;
+}
+
+void DiskImage::setFatEntry(int cluster, int value)
+{
+    fat.next[cluster] = (unsigned short)value;
+    // 全てのFATコピーを更新
+    for (int i = 0; i < boot.fatCopy; i++) {
+        unsigned char* f = image[boot.fatPosition + boot.fatSize * i];
+        FAT12::set(f, cluster, (unsigned short)value);
+        markDirty(&f[cluster + cluster / 2], 2);
+    }
+}
+
+unsigned char* DiskImage::getClusterPointer(int cluster) const
+{
+    return image[boot.dataPosition + (cluster - 2) * boot.clusterSize];
+}
+
+void DiskImage::releaseClusterChain(int cluster)
+{
+    int maxCluster = getMaxCluster();
+    for (int n = 0; isChainCluster(cluster) && n < maxCluster; n++) {
+        int next = getFatEntry(cluster);
+        setFatEntry(cluster, 0);
+        cluster = next;
+    }
+}
+
+int DiskImage::findFreeCluster() const
+{
+    for (int c = 2; c <= getMaxCluster(); c++) {
+        if (0 == getFatEntry(c)) return c;
+    }
+    return -1;
+}
+
+int DiskImage::countFreeCluster() const
+{
+    int freeCluster = 0;
+    for (int c = 2; c <= getMaxCluster(); c++) {
+        if (0 == getFatEntry(c)) freeCluster++;
+    }
+    return freeCluster;
+}
+
+unsigned char* DiskImage::getDirectoryEntryPointer(const Directory* d, int i) const
+{
+    if (!d->cluster) {
+        return image[boot.directoryPosition] + i * 32;
+    }
+    int epc = getClusterBytes() / 32; // entries per cluster
+    return getClusterPointer(d->chain[i / epc]) + (i % epc) * 32;
+}
+
+void DiskImage::addDirectoryIndex(Directory* d, int i)
+{
+    unsigned int mask = d->indexSize - 1;
+    for (unsigned int h = hashNameKey(d->entries[i].key) & mask;; h = (h + 1) & mask) {
+        if (d->indexTable[h] <= 0) {
+            d->indexTable[h] = i + 1;
+            return;
+        }
+    }
+}
+
+void DiskImage::removeDirectoryIndex(Directory* d, int i)
+{
+    unsigned int mask = d->indexSize - 1;
+    unsigned int h = hashNameKey(d->entries[i].key) & mask;
+    for (int n = 0; n < d->indexSize && d->indexTable[h]; n++, h = (h + 1) & mask) {
+        if (d->indexTable[h] == i + 1) {
+            d->indexTable[h] = -1;
+            return;
+        }
+    }
+}
+
+int DiskImage::findDirectoryEntry(const Directory* d, const char* name, const char* ext) const
+{
+    NameKey key = makeNameKey(name, ext);
+    unsigned int mask = d->indexSize - 1;
+    unsigned int h = hashNameKey(key) & mask;
+    for (int n = 0; n < d->indexSize && d->indexTable[h]; n++, h = (h + 1) & mask) {
+        int i = d->indexTable[h] - 1;
+        if (0 <= i && d->entries[i].key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Decode the directory entry of the slot and register it to the index
+void DiskImage::updateDirectoryEntry(Directory* d, int i)
+{
+    if (i < d->entryCount && !d->entries[i].removed) {
+        removeDirectoryIndex(d, i);
+    }
+    extractDirectoryEntry(&d->entries[i], getDirectoryEntryPointer(d, i));
+    if (d->entryCount <= i) {
+        d->entryCount = i + 1;
+    }
+    if (!d->entries[i].removed) {
+        addDirectoryIndex(d, i);
+    }
+}
+
+// Resize the entries and the index for the capacity (number of the slots on disk)
+bool DiskImage::reserveDirectory(Directory* d, int capacity)
+{
+    Entry* entries = (Entry*)realloc(d->entries, capacity * sizeof(Entry));
+    if (!entries) return fail(NoMemory, "No memory");
+    d->entries = entries;
+    int indexSize = 16;
+    while (indexSize < capacity * 2) indexSize *= 2;
+    if (indexSize != d->indexSize) {
+        int* indexTable = (int*)realloc(d->indexTable, indexSize * sizeof(int));
+        if (!indexTable) return fail(NoMemory, "No memory");
+        d->indexTable = indexTable;
+        d->indexSize = indexSize;
+        memset(d->indexTable, 0, indexSize * sizeof(int));
+        for (int i = 0; i < d->entryCount && i < capacity; i++) {
+            if (!d->entries[i].removed) addDirectoryIndex(d, i);
+        }
+    }
+    d->entryCapacity = capacity;
+    return true;
+}
+
+bool DiskImage::extractDirectory(Directory* d)
+{
+    int capacity = boot.directoryEntry;
+    d->chainCount = 0;
+    if (d->cluster) {
+        // サブディレクトリはクラスタのチェインを辿って全クラスタを記憶
+        int maxCluster = getMaxCluster();
+        for (int c = d->cluster, n = 0; isChainCluster(c) && n < maxCluster; c = getFatEntry(c), n++) {
+            unsigned short* chain = (unsigned short*)realloc(d->chain, (d->chainCount + 1) * sizeof(unsigned short));
+            if (!chain) return fail(NoMemory, "No memory");
+            d->chain = chain;
+            d->chain[d->chainCount++] = (unsigned short)c;
+        }
+        capacity = d->chainCount * getClusterBytes() / 32;
+    }
+    d->entryCount = 0;
+    if (!reserveDirectory(d, capacity)) return false;
+    memset(d->indexTable, 0, d->indexSize * sizeof(int));
+    while (d->entryCount < capacity && *getDirectoryEntryPointer(d, d->entryCount)) {
+        updateDirectoryEntry(d, d->entryCount);
+    }
+    return true;
+}
+
+void DiskImage::freeDirectory(Directory* d)
+{
+    free(d->chain);
+    free(d->entries);
+    free(d->indexTable);
+    memset(d, 0, sizeof(Directory));
+}
+
+void DiskImage::clearDirectoryCache()
+{
+    for (int i = 0; i < dirCacheSize; i++) {
+        if (dirCache[i]) {
+            freeDirectory(dirCache[i]);
+            free(dirCache[i]);
+        }
+    }
+    free(dirCache);
+    dirCache = nullptr;
+    dirCacheSize = 0;
+}
+
+bool DiskImage::extractDirectoryFromDisk()
+{
+    clearDirectoryCache();
+    dir.cluster = 0;
+    dir.parent = nullptr;
+    return extractDirectory(&dir);
+}
+
+DiskImage::Directory* DiskImage::openSubDirectory(Directory* parent, int i)
+{
+    const Entry* e = &parent->entries[i];
+    if (!e->attr.dirent || !isChainCluster(e->cluster)) {
+        fail(InvalidPath, "Directory not found");
+        return nullptr;
+    }
+    if (!dirCache) {
+        dirCache = (Directory**)calloc(fat.clusterCount, sizeof(Directory*));
+        if (!dirCache) {
+            fail(NoMemory, "No memory");
+            return nullptr;
+        }
+        dirCacheSize = fat.clusterCount;
+    }
+    if (!dirCache[e->cluster]) {
+        Directory* d = (Directory*)calloc(1, sizeof(Directory));
+        if (!d) {
+            fail(NoMemory, "No memory");
+            return nullptr;
+        }
+        d->parent = parent;
+        d->cluster = e->cluster;
+        if (!extractDirectory(d)) {
+            freeDirectory(d);
+            free(d);
+            return nullptr;
+        }
+        dirCache[e->cluster] = d;
+    }
+    return dirCache[e->cluster];
+}
+
+DiskImage::Directory* DiskImage::changeDirectory(Directory* d, char* component)
+{
+    if (0 == strcmp(component, ".")) return d;
+    if (0 == strcmp(component, "..")) return d->parent ? d->parent : d;
+    char name[9];
+    char ext[4];
+    if (!parseDisplayName(component, name, ext)) return nullptr;
+    int i = findDirectoryEntry(d, name, ext);
+    if (i < 0) {
+        fail(InvalidPath, "Directory not found");
+        return nullptr;
+    }
+    return openSubDirectory(d, i);
+}
+
+// Resolve the directory part of the path (A/B/FILE.EXT) and return the last element to the fileName
+DiskImage::Directory* DiskImage::resolveDirectory(char* path, char** fileName)
+{
+    Directory* d = &dir;
+    char* cp = path;
+    for (char* sep = strpbrk(cp, "/\\"); d && sep; sep = strpbrk(cp, "/\\")) {
+        char c = *sep;
+        *sep = 0;
+        if (*cp) d = changeDirectory(d, cp);
+        *sep = c;
+        cp = sep + 1;
+    }
+    *fileName = cp;
+    return d;
+}
+
+DiskImage::Directory* DiskImage::openDirectory(const char* path)
+{
+    if (!path) return &dir;
+    char target[4096];
+    if (sizeof(target) <= strlen(path)) {
+        fail(InvalidPath, "Directory not found");
+        return nullptr;
+    }
+    strcpy(target, path);
+    char* fileName;
+    Directory* d = resolveDirectory(target, &fileName);
+    return d && *fileName ? changeDirectory(d, fileName) : d;
+}
+
+bool DiskImage::parseDisplayName(char* displayName, char* name, char* ext)
+{
+    if (16 <= strlen(displayName)) {
+        return fail(InvalidPath, "File not found (invalid length)");
+    }
+    char* cp = strchr(displayName, '.');
+    if (cp) {
+        *cp = 0;
+        cp++;
+        if (3 < strlen(cp)) {
+            cp[-1] = '.';
+            return fail(InvalidPath, "File not found (invalid ext length)");
+        }
+        strcpy(ext, cp);
+        cp--;
+    } else {
+        strcpy(ext, "   ");
+    }
+    if (8 < strlen(displayName)) {
+        if (cp) *cp = '.';
+        return fail(InvalidPath, "File not found (invalid name length)");
+    }
+    strncpy(name, displayName, 8);
+    name[8] = 0;
+    ext[3] = 0;
+    int i;
+    for (i = 0; ext[i]; i++) ext[i] = toupper(ext[i]);
+    for (; i < 3; i++) ext[i] = ' ';
+    for (i = 0; name[i]; i++) name[i] = toupper(name[i]);
+    for (; i < 8; i++) name[i] = ' ';
+    if (cp) *cp = '.';
+    return true;
+}
+
+// Find the first removed (or unused) slot (entryCapacity: needs extendDirectory)
+int DiskImage::findFreeSlot(const Directory* d) const
+{
+    int slot = 0;
+    while (slot < d->entryCount && !d->entries[slot].removed) slot++;
+    return slot;
+}
+
+// Append a cluster to the sub directory
+bool DiskImage::extendDirectory(Directory* d)
+{
+    int c = d->cluster ? findFreeCluster() : -1;
+    if (c < 0) return fail(DiskFull, "Disk Full");
+    unsigned short* chain = (unsigned short*)realloc(d->chain, (d->chainCount + 1) * sizeof(unsigned short));
+    if (!chain) return fail(NoMemory, "No memory");
+    d->chain = chain;
+    setFatEntry(d->chain[d->chainCount - 1], c);
+    setFatEntry(c, 0xFFF);
+    memset(getClusterPointer(c), 0, getClusterBytes());
+    markDirty(getClusterPointer(c), getClusterBytes());
+    d->chain[d->chainCount++] = (unsigned short)c;
+    return reserveDirectory(d, d->chainCount * getClusterBytes() / 32);
+}
+
+void DiskImage::writeDirectoryEntry(unsigned char* ptr, const char* name, const char* ext, unsigned char attr, const unsigned char* date, unsigned short cluster, unsigned int size)
+{
+    memset(ptr, 0, 32);
+    memcpy(ptr, name, 8);
+    memcpy(ptr + 8, ext, 3);
+    ptr[11] = attr;
+    memcpy(ptr + 22, date, 4);
+    memcpy(ptr + 26, &cluster, 2);
+    memcpy(ptr + 28, &size, 4);
+    markDirty(ptr, 32);
+}
+
+void DiskImage::close()
+{
+    if (image) {
+        if (imageFile.mapped) {
+            munmap(image, imageFile.size);
+        } else {
+            free(image);
+        }
+        image = nullptr;
+    }
+    if (0 <= imageFile.fd) {
+        ::close(imageFile.fd);
+    }
+    free(imageFile.dirty);
+    memset(&imageFile, 0, sizeof(imageFile));
+    imageFile.fd = -1;
+    free(fat.next);
+    fat.next = nullptr;
+    clearDirectoryCache();
+    freeDirectory(&dir);
+    free(path);
+    path = nullptr;
+}
+
+bool DiskImage::open(const char* path, bool writable)
+{
+    close();
+    error = NoError;
+    errorMessage = "";
+    if (!setPath(path)) return false;
+    int fd = ::open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return fail(NotFound, "File not found");
+    struct stat st;
+    if (0 != fstat(fd, &st) || st.st_size < 512 || 0 != st.st_size % 512 || 0xFFFF * 512 < st.st_size) {
+        ::close(fd);
+        return fail(Unsupported, "Unsupported disk image");
+    }
+    imageFile.size = (size_t)st.st_size;
+    // MAP_PRIVATE でアクセスしたページのみ読み込み、変更したセクタは flush で書き戻す
+    void* ptr = mmap(nullptr, imageFile.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED != ptr) {
+        image = (unsigned char(*)[512])ptr;
+        imageFile.mapped = true;
+    } else {
+        // mmap できないファイルシステムの場合はヒープに読み込む
+        image = (unsigned char(*)[512])malloc(imageFile.size);
+        if (!image) {
+            ::close(fd);
+            return fail(NoMemory, "No memory");
+        }
+        if ((ssize_t)imageFile.size != pread(fd, image, imageFile.size, 0)) {
+            free(image);
+            image = nullptr;
+            ::close(fd);
+            return fail(IOError, "I/O error");
+        }
+    }
+    imageFile.fd = fd;
+    imageFile.writable = writable;
+    extractBootSectorFromDisk();
+    if (!isValidBootSector(imageFile.size)) {
+        // BPBが無い (又は壊れている) 場合はファイルサイズから標準のジオメトリを推定
+        const Format* format = nullptr;
+        for (int i = 0; formats[i].name; i++) {
+            if ((size_t)formats[i].numberOfSector * 512 == imageFile.size) format = &formats[i];
+        }
+        if (format) {
+            unsigned char bpb[0x30];
+            memcpy(bpb, image[0], sizeof(bpb));
+            setupBootSector(format);
+            memcpy(boot.bootJump, &bpb[0x00], 3);
+            memcpy(boot.oemName, &bpb[0x03], 8);
+            memcpy(boot.bootProgram, &image[0][0x30], sizeof(boot.bootProgram));
+        }
+        if (!format || !isValidBootSector(imageFile.size)) {
+            close();
+            return fail(Unsupported, "Unsupported disk image");
+        }
+    }
+    if (!allocateDirtyMap((int)(imageFile.size / 512)) || !extractFatFromDisk() || !extractDirectoryFromDisk()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool DiskImage::create(const char* path, const Format& format)
+{
+    close();
+    error = NoError;
+    errorMessage = "";
+    setupBootSector(&format);
+    imageFile.size = (size_t)boot.numberOfSector * boot.sectorSize;
+    image = (unsigned char(*)[512])calloc(1, imageFile.size);
+    if (!image) return fail(NoMemory, "No memory");
+    if (!setPath(path) || !allocateDirtyMap(boot.numberOfSector)) {
+        close();
+        return false;
+    }
+    imageFile.created = true;
+    markDirty(image, imageFile.size);
+
+    // Create Boot Sector (DOS2のブートプログラムには MSXDOS2.SYS の書き込み時に切り替える)
+    unsigned char bootJump[3] = {0xEB, 0xFE, 0x90};
+    unsigned char bootJump2[2] = {0xD0, 0xED};
+    memcpy(boot.bootJump, bootJump, 3);
+    memcpy(boot.oemName, "SZKPLN01", 8);
+    memcpy(boot.bootJump2, bootJump2, 2);
+    memcpy(boot.idLabel, "VOL_ID", 6);
+    boot.dirtyFlag = 0x36;
+    // ボリュームIDは乱数 (同時に作成するイメージで重複しないようにインスタンスのアドレスも混ぜる)
+    unsigned int seed = (unsigned int)time(nullptr) ^ (unsigned int)(size_t)this ^ (unsigned int)clock();
+    for (int i = 0; i < 4; i++) {
+        seed = seed * 1103515245 + 12345;
+        boot.idValue[i] = (seed >> 16) & 0xFF;
+    }
+    boot.idValue[0] |= 0x01;
+    memcpy(boot.bootProgram, dos1BootProgram, sizeof(dos1BootProgram));
+    extractBootSectorToDisk();
+
+    // Create FAT (空のルートディレクトリは0で初期化済み)
+    if (!extractFatFromDisk()) {
+        close();
+        return false;
+    }
+    setFatEntry(0, 0xF00 | boot.mediaId);
+    setFatEntry(1, 0xFFF);
+    fat.fatId = boot.mediaId;
+    if (!extractDirectoryFromDisk()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool DiskImage::flush()
+{
+    if (!image) return fail(IOError, "I/O error");
+    if (!isModified()) return true;
+    // 新規作成時以外は既存のファイルを切り詰めずに変更したセクタのみ書き戻す
+    int fd = imageFile.writable ? imageFile.fd : ::open(path, imageFile.created ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY, 0644);
+    if (fd < 0) return fail(IOError, "I/O error");
+    bool result = true;
+    for (int sector = 0; result && sector < imageFile.sectorCount; sector++) {
+        if (!isDirty(sector)) continue;
+        // 連続する変更セクタはまとめて1回で書き込む
+        int count = 1;
+        while (sector + count < imageFile.sectorCount && isDirty(sector + count)) count++;
+        const unsigned char* ptr = image[sector];
+        off_t ofs = (off_t)sector * 512;
+        for (size_t done = 0; done < (size_t)count * 512;) {
+            ssize_t n = pwrite(fd, ptr + done, count * 512 - done, ofs + done);
+            if (n <= 0) {
+                result = fail(IOError, "I/O error");
+                break;
+            }
+            done += n;
+        }
+        sector += count - 1;
+    }
+    if (fd != imageFile.fd) ::close(fd);
+    if (result) {
+        memset(imageFile.dirty, 0, (imageFile.sectorCount + 7) / 8);
+        imageFile.created = false;
+    }
+    return result;
+}
+
+const DiskImage::Entry* DiskImage::findFile(const char* path)
+{
+    char target[4096];
+    if (sizeof(target) <= strlen(path)) {
+        fail(InvalidPath, "File not found (invalid length)");
+        return nullptr;
+    }
+    strcpy(target, path);
+    char* displayName;
+    char name[9];
+    char ext[4];
+    Directory* d = resolveDirectory(target, &displayName);
+    if (!d || !parseDisplayName(displayName, name, ext)) return nullptr;
+    int i = findDirectoryEntry(d, name, ext);
+    if (i < 0) {
+        fail(NotFound, "File not found");
+        return nullptr;
+    }
+    if (d->entries[i].attr.dirent) {
+        fail(IsDirectory, "Is a directory");
+        return nullptr;
+    }
+    return &d->entries[i];
+}
+
+int DiskImage::findEntry(const Directory* d, const char* displayName)
+{
+    char target[16];
+    char name[9];
+    char ext[4];
+    if (sizeof(target) <= strlen(displayName)) return -1;
+    strcpy(target, displayName);
+    if (!parseDisplayName(target, name, ext)) return -1;
+    return findDirectoryEntry(d, name, ext);
+}
+
+bool DiskImage::setDate(Directory* d, int i, const unsigned char* date)
+{
+    if (i < 0 || d->entryCount <= i || d->entries[i].removed) return fail(NotFound, "File not found");
+    unsigned char* ptr = getDirectoryEntryPointer(d, i);
+    if (0 == memcmp(ptr + 22, date, 4)) return true;
+    // ディレクトリエントリの日時のみ書き換える
+    memcpy(ptr + 22, date, 4);
+    markDirty(ptr + 22, 4);
+    updateDirectoryEntry(d, i);
+    return true;
+}
+
+int DiskImage::getExtents(const Entry* entry, Extent* extents, int capacity) const
+{
+    int count = 0;
+    int size = entry->size;
+    int cs = getClusterBytes();
+    // 先頭クラスタはディレクトリエントリ、2番目以降はFATのチェインを辿り、連続するクラスタは1つの範囲にまとめる
+    int prev = 0;
+    int cluster = entry->cluster;
+    for (int n = 0; 0 < size && isChainCluster(cluster) && n < getMaxCluster(); n++) {
+        if (prev + 1 == cluster) {
+            if (count <= capacity) extents[count - 1].count += boot.clusterSize;
+        } else {
+            if (count < capacity) {
+                extents[count].sector = boot.dataPosition + (cluster - 2) * boot.clusterSize;
+                extents[count].count = boot.clusterSize;
+            }
+            count++;
+        }
+        size -= cs;
+        prev = cluster;
+        cluster = getFatEntry(cluster);
+    }
+    return count;
+}
+
+// Extents of the file in the buffer (or in the allocated memory if the buffer is short, the caller frees it)
+DiskImage::Extent* DiskImage::resolveExtents(const Entry* entry, Extent* buffer, int capacity, int* count) const
+{
+    *count = getExtents(entry, buffer, capacity);
+    if (*count <= capacity) return buffer;
+    Extent* extents = (Extent*)malloc(*count * sizeof(Extent));
+    if (extents) getExtents(entry, extents, *count);
+    return extents;
+}
+
+bool DiskImage::read(const Entry* entry, void* buffer)
+{
+    Extent local[16];
+    int count;
+    Extent* extents = resolveExtents(entry, local, 16, &count);
+    if (!extents) return fail(NoMemory, "No memory");
+    unsigned char* buf = (unsigned char*)buffer;
+    size_t remain = entry->size;
+    for (int i = 0; i < count; i++) {
+        size_t len = (size_t)extents[i].count * 512;
+        if (remain < len) len = remain;
+        memcpy(buf, image[extents[i].sector], len);
+        buf += len;
+        remain -= len;
+    }
+    if (extents != local) free(extents);
+    // FATのチェインが途中で切れている (ファイルサイズに満たない)
+    if (remain) return fail(IOError, "I/O error (broken cluster chain)");
+    return true;
+}
+
+bool DiskImage::read(const Entry* entry, FILE* fp)
+{
+    Extent local[16];
+    int count;
+    Extent* extents = resolveExtents(entry, local, 16, &count);
+    if (!extents) return fail(NoMemory, "No memory");
+    bool result = true;
+    size_t remain = entry->size;
+    for (int i = 0; result && i < count; i++) {
+        size_t len = (size_t)extents[i].count * 512;
+        if (remain < len) len = remain;
+        result = len == fwrite(image[extents[i].sector], 1, len, fp);
+        remain -= len;
+    }
+    if (extents != local) free(extents);
+    if (!result) return fail(IOError, "I/O error");
+    // FATのチェインが途中で切れている (ファイルサイズに満たない)
+    if (remain) return fail(IOError, "I/O error (broken cluster chain)");
+    return true;
+}
+
+bool DiskImage::write(const char* path, const void* data, size_t size, const unsigned char* date)
+{
+    char target[4096];
+    if (sizeof(target) <= strlen(path)) return fail(InvalidPath, "File not found (invalid length)");
+    strcpy(target, path);
+    char* displayName;
+    char name[9];
+    char ext[4];
+    Directory* dd = resolveDirectory(target, &displayName);
+    if (!dd) return false;
+    if (!*displayName) return fail(InvalidPath, "File not found (invalid name length)");
+    if (!parseDisplayName(displayName, name, ext)) return false;
+    unsigned char now[4];
+    if (!date) {
+        getDate(now);
+        date = now;
+    }
+
+    // 上書き対象のエントリ (無ければ空きエントリ) を探す
+    int slot = findDirectoryEntry(dd, name, ext);
+    bool overwrite = 0 <= slot;
+    if (overwrite && dd->entries[slot].attr.dirent) return fail(IsDirectory, "Is a directory");
+    if (!overwrite) {
+        slot = findFreeSlot(dd);
+        if (dd->entryCapacity <= slot && !dd->cluster) return fail(DiskFull, "Disk Full");
+    }
+
+    // 空きクラスタ数を確認 (上書きの場合は解放されるクラスタも含め、サブディレクトリの拡張分を除く)
+    int cs = getClusterBytes();
+    int maxCluster = getMaxCluster();
+    int freeCluster = countFreeCluster();
+    if (overwrite) {
+        int c = dd->entries[slot].cluster;
+        for (int n = 0; isChainCluster(c) && n < maxCluster; n++) {
+            freeCluster++;
+            c = getFatEntry(c);
+        }
+    }
+    if (dd->entryCapacity <= slot) {
+        freeCluster--;
+    }
+    if (freeCluster < (int)((size + cs - 1) / cs)) return fail(DiskFull, "Disk Full");
+
+    // 既存ファイルのクラスタを解放 (又はサブディレクトリを拡張)
+    if (overwrite) {
+        releaseClusterChain(dd->entries[slot].cluster);
+    } else if (dd->entryCapacity <= slot && !extendDirectory(dd)) {
+        return false;
+    }
+
+    // 空きクラスタを確保してファイル内容を書き込む
+    const unsigned char* ptr = (const unsigned char*)data;
+    size_t remain = size;
+    int start = 0;
+    int prev = 0;
+    for (int c = 2; c <= maxCluster && 0 < remain; c++) {
+        if (0 != getFatEntry(c)) continue;
+        if (prev) {
+            setFatEntry(prev, c);
+        } else {
+            start = c;
+        }
+        setFatEntry(c, 0xFFF);
+        int len = remain < (size_t)cs ? (int)remain : cs;
+        memcpy(getClusterPointer(c), ptr, len);
+        memset(getClusterPointer(c) + len, 0, cs - len);
+        markDirty(getClusterPointer(c), cs);
+        ptr += len;
+        remain -= len;
+        prev = c;
+    }
+
+    // ディレクトリエントリを更新
+    writeDirectoryEntry(getDirectoryEntryPointer(dd, slot), name, ext, 0, date, (unsigned short)start, (unsigned int)size);
+    updateDirectoryEntry(dd, slot);
+
+    // MSXDOS2.SYS を (ルートに) 書き込んだ場合はブートプログラムをDOS2用に更新
+    if (dd == &dir && 0 == memcmp(name, "MSXDOS2 ", 8) && 0 == memcmp(ext, "SYS", 3)) {
+        memcpy(boot.bootProgram, dos2BootProgram, sizeof(dos2BootProgram));
+        extractBootSectorToDisk();
+    }
+    return true;
+}
+
+bool DiskImage::makeDirectory(const char* path)
+{
+    char target[4096];
+    if (sizeof(target) <= strlen(path)) return fail(InvalidPath, "File not found (invalid length)");
+    strcpy(target, path);
+    char* displayName;
+    char name[9];
+    char ext[4];
+    Directory* dd = resolveDirectory(target, &displayName);
+    if (!dd || !parseDisplayName(displayName, name, ext)) return false;
+    if ('.' == name[0] || ' ' == name[0]) return fail(InvalidPath, "Invalid directory name");
+    if (0 <= findDirectoryEntry(dd, name, ext)) return fail(AlreadyExists, "File exists");
+    int slot = findFreeSlot(dd);
+    bool extend = dd->entryCapacity <= slot;
+    if ((extend && !dd->cluster) || countFreeCluster() < (extend ? 2 : 1)) return fail(DiskFull, "Disk Full");
+    if (extend && !extendDirectory(dd)) return false;
+    // 1クラスタ確保して . と .. のエントリを作成
+    unsigned char now[4];
+    getDate(now);
+    int c = findFreeCluster();
+    int cs = getClusterBytes();
+    setFatEntry(c, 0xFFF);
+    unsigned char* ptr = getClusterPointer(c);
+    memset(ptr, 0, cs);
+    writeDirectoryEntry(ptr, ".       ", "   ", 0x10, now, (unsigned short)c, 0);
+    writeDirectoryEntry(ptr + 32, "..      ", "   ", 0x10, now, dd->cluster, 0);
+    markDirty(ptr, cs);
+    writeDirectoryEntry(getDirectoryEntryPointer(dd, slot), name, ext, 0x10, now, (unsigned short)c, 0);
+    updateDirectoryEntry(dd, slot);
+    return true;
+}
+
+bool DiskImage::remove(const char* path)
+{
+    char target[4096];
+    if (sizeof(target) <= strlen(path)) return fail(InvalidPath, "File not found (invalid length)");
+    strcpy(target, path);
+    char* displayName;
+    char name[9];
+    char ext[4];
+    Directory* dd = resolveDirectory(target, &displayName);
+    if (!dd || !parseDisplayName(displayName, name, ext)) return false;
+    int i = findDirectoryEntry(dd, name, ext);
+    if (i < 0 || '.' == name[0]) return fail(NotFound, "File not found");
+    if (dd->entries[i].attr.dirent) {
+        // 空のディレクトリのみ削除可能
+        Directory* sub = openSubDirectory(dd, i);
+        if (sub) {
+            for (int j = 0; j < sub->entryCount; j++) {
+                if (!sub->entries[j].removed && '.' != sub->entries[j].name[0]) return fail(NotEmpty, "Directory not empty");
+            }
+            dirCache[sub->cluster] = nullptr;
+            freeDirectory(sub);
+            free(sub);
+        }
+    }
+    // クラスタを解放してディレクトリエントリを削除済み (0xE5) にする
+    releaseClusterChain(dd->entries[i].cluster);
+    unsigned char* ptr = getDirectoryEntryPointer(dd, i);
+    *ptr = 0xE5;
+    markDirty(ptr, 1);
+    updateDirectoryEntry(dd, i);
+    // MSXDOS2.SYS を (ルートから) 削除した場合はブートプログラムをDOS1用に戻す
+    if (dd == &dir && 0 == strcmp(name, "MSXDOS2 ") && 0 == strcmp(ext, "SYS") && 0 == memcmp(boot.bootProgram, dos2BootProgram, sizeof(dos2BootProgram))) {
+        memcpy(boot.bootProgram, dos1BootProgram, sizeof(dos1BootProgram));
+        extractBootSectorToDisk();
+    }
+    return true;
+}
+
+// Collect the first clusters of the chains under the directory (owner: 1 = in a chain, 2 = first cluster)
+bool DiskImage::collectChains(Directory* d, unsigned short* starts, int* startCount, unsigned char* owner)
+{
+    int maxCluster = getMaxCluster();
+    for (int i = 0; i < d->entryCount; i++) {
+        const Entry* e = &d->entries[i];
+        if (e->removed || '.' == e->name[0] || !isChainCluster(e->cluster)) continue;
+        // 複数のエントリから参照 (又はループ) しているチェインは移動できない
+        for (int c = e->cluster, n = 0; isChainCluster(c) && n < maxCluster; c = getFatEntry(c), n++) {
+            if (owner[c]) return fail(Unsupported, "Broken cluster chain");
+            owner[c] = c == e->cluster ? 2 : 1;
+        }
+        starts[(*startCount)++] = e->cluster;
+        if (e->attr.dirent) {
+            Directory* sub = openSubDirectory(d, i);
+            if (!sub || !collectChains(sub, starts, startCount, owner)) return false;
+        }
+    }
+    return true;
+}
+
+// Replace the first clusters of the entries in the directory (0: root) and the sub directories by the map
+void DiskImage::relocateDirectory(int cluster, const unsigned short* map)
+{
+    int epc = cluster ? getClusterBytes() / 32 : boot.directoryEntry; // entries per cluster
+    for (int n = 0; n < getMaxCluster(); n++) {
+        unsigned char* ptr = cluster ? getClusterPointer(cluster) : image[boot.directoryPosition];
+        for (int i = 0; i < epc; i++, ptr += 32) {
+            if (0 == *ptr) return;
+            if (0xE5 == *ptr) continue;
+            unsigned short c;
+            memcpy(&c, ptr + 26, 2);
+            if (!isChainCluster(c) || !map[c]) continue;
+            if (map[c] != c) {
+                memcpy(ptr + 26, &map[c], 2);
+                markDirty(ptr + 26, 2);
+            }
+            if ((ptr[11] & 0x10) && '.' != *ptr) relocateDirectory(map[c], map);
+        }
+        if (!cluster) return;
+        cluster = getFatEntry(cluster);
+        if (!isChainCluster(cluster)) return;
+    }
+}
+
+bool DiskImage::defragment(const Entry* const* order, int count)
+{
+    int clusterCount = fat.clusterCount;
+    int cs = getClusterBytes();
+    unsigned char* owner = (unsigned char*)calloc(clusterCount, 1);
+    unsigned short* starts = (unsigned short*)malloc(clusterCount * sizeof(unsigned short));
+    unsigned short* sequence = (unsigned short*)malloc(clusterCount * sizeof(unsigned short));
+    unsigned short* map = (unsigned short*)calloc(clusterCount, sizeof(unsigned short));
+    unsigned short* next = (unsigned short*)malloc(clusterCount * sizeof(unsigned short));
+    unsigned char* data = (unsigned char*)malloc((size_t)clusterCount * cs);
+    unsigned char* packed = (unsigned char*)malloc((size_t)boot.fatSize * boot.sectorSize);
+    bool result = owner && starts && sequence && map && next && data && packed ? true : fail(NoMemory, "No memory");
+    int startCount = 0;
+    if (result) result = collectChains(&dir, starts, &startCount, owner);
+    if (result) {
+        // 配置順: order のチェイン → それ以外のチェイン (ディレクトリ順)
+        int sequenceCount = 0;
+        for (int i = 0; i < count; i++) {
+            int c = order[i]->cluster;
+            if (isChainCluster(c) && 2 == owner[c]) {
+                sequence[sequenceCount++] = (unsigned short)c;
+                owner[c] = 3;
+            }
+        }
+        for (int i = 0; i < startCount; i++) {
+            if (2 == owner[starts[i]]) sequence[sequenceCount++] = starts[i];
+        }
+
+        // 新しいクラスタ番号を先頭から割り当てる (チェイン外の使用中クラスタは移動しない)
+        int maxCluster = getMaxCluster();
+        for (int c = 0; c <= maxCluster; c++) {
+            next[c] = owner[c] ? 0 : getFatEntry(c);
+        }
+        int to = 2;
+        for (int i = 0; i < sequenceCount; i++) {
+            int prev = 0;
+            int c = sequence[i];
+            for (int n = 0; isChainCluster(c) && n < maxCluster; c = getFatEntry(c), n++) {
+                while (!owner[to] && getFatEntry(to)) to++;
+                map[c] = (unsigned short)to;
+                memcpy(data + (size_t)to * cs, getClusterPointer(c), cs);
+                if (prev) next[map[prev]] = (unsigned short)to;
+                prev = c;
+                to++;
+            }
+            int end = getFatEntry(prev);
+            next[map[prev]] = (unsigned short)(0xFF8 <= end ? end : 0xFFF);
+        }
+
+        // 内容が変わるクラスタとFATエントリのみ書き換える
+        for (int c = 2; c < to; c++) {
+            if (!owner[c] && getFatEntry(c)) continue;
+            unsigned char* ptr = getClusterPointer(c);
+            if (0 != memcmp(ptr, data + (size_t)c * cs, cs)) {
+                memcpy(ptr, data + (size_t)c * cs, cs);
+                markDirty(ptr, cs);
+            }
+        }
+        // FATは全体を各コピーへエンコードし、内容が変わるセクタのみ書き換える
+        for (int i = 0; i < boot.fatCopy; i++) {
+            unsigned char* f = image[boot.fatPosition + boot.fatSize * i];
+            memcpy(packed, f, (size_t)boot.fatSize * boot.sectorSize);
+            FAT12::encode(next, packed, clusterCount);
+            for (int sector = 0; sector < boot.fatSize; sector++) {
+                unsigned char* ptr = f + sector * boot.sectorSize;
+                if (0 != memcmp(ptr, packed + sector * boot.sectorSize, boot.sectorSize)) {
+                    memcpy(ptr, packed + sector * boot.sectorSize, boot.sectorSize);
+                    markDirty(ptr, boot.sectorSize);
+                }
+            }
+        }
+        memcpy(fat.next, next, clusterCount * sizeof(unsigned short));
+        relocateDirectory(0, map);
+        result = extractDirectoryFromDisk();
+    }
+    free(owner);
+    free(starts);
+    free(sequence);
+    free(map);
+    free(next);
+    free(data);
+    free(packed);
+    return result;
+}
@@ -0,0 +1,299 @@
+/**
+ * SUZUKI PLAN - MSX Disk Image
+ * Read and write of the MSX-DOS (FAT12) disk image
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_DISKIMAGE_HPP
+#define INCLUDE_DISKIMAGE_HPP
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+// A disk image opened in memory (libdskmgr.a)
+// - Every state belongs to the instance, so many images can be opened in a process at the same time
+// - Different instances can be used from different threads, but an instance needs a lock of the caller
+//   (only read and the const functions can be called from multiple threads at the same time,
+//    the error of a failed read is shared by the threads)
+// - Modifications are applied to the memory and written back by flush (close discards them)
+// - Paths on the disk are A/B/FILE.EXT (separator: / or \, case insensitive)
+// - Functions return false (or nullptr) on error, and the reason is returned by getError / getErrorMessage
+class DiskImage
+{
+  public:
+    // Geometry of the disk (see -f option of the create command)
+    struct Format {
+        const char* name;
+        unsigned short numberOfSector;
+        unsigned char clusterSize;
+        unsigned short fatSize;
+        unsigned short directoryEntry;
+        unsigned char mediaId;
+        unsigned short sectorPerTrack;
+        unsigned short diskSides;
+    };
+
+    // Standard MSX floppy disks: 1DD, 2DD (default), 2HD (terminated by name = nullptr)
+    static const Format formats[];
+
+    // Parse 1DD, 2DD, 2HD or SECTORS,CLUSTER,DIRENT[,MEDIA]
+    static bool parseFormat(const char* str, Format* result);
+
+    enum Error {
+        NoError = 0,
+        InvalidPath,   // invalid file name or directory not found
+        NotFound,      // file not found
+        AlreadyExists, // mkdir to the existing name
+        IsDirectory,   // read or write a directory as a file
+        NotEmpty,      // remove the directory that has files
+        DiskFull,      // no free cluster or directory entry
+        NoMemory,
+        IOError,
+        Unsupported, // unsupported disk image
+    };
+
+    // NOTE: Boundary-unaware data structure to be expanded at read time
+    struct BootSector {
+        unsigned char bootJump[3];
+        unsigned char oemName[9];
+        unsigned short sectorSize;
+        unsigned char clusterSize;
+        unsigned short fatPosition;
+        unsigned char fatCopy;
+        unsigned short directoryEntry;
+        unsigned short numberOfSector;
+        unsigned char mediaId; // F8: Fixed Media, F0: Removal Media
+        unsigned short fatSize;
+        unsigned short sectorPerTrack;
+        unsigned short diskSides;
+        unsigned short hiddenSector;
+        unsigned char bootJump2[2];
+        unsigned char idLabel[7];
+        unsigned char dirtyFlag;
+        unsigned char idValue[4];
+        unsigned char reserved[5];
+        unsigned char bootProgram[0x1D0];
+        int directoryPosition;
+        int dataPosition;
+    };
+
+    // Packed 8.3 name (upper case, space padded) used as the key of the directory index
+    struct NameKey {
+        unsigned long long name;
+        unsigned int ext;
+        bool operator==(const NameKey& k) const { return name == k.name && ext == k.ext; }
+    };
+
+    // Parsed directory (the entries are valid until the directory is modified)
+    struct Directory {
+        Directory* parent;      // nullptr: root directory
+        unsigned short cluster; // first cluster (0: root directory)
+        int chainCount;
+        unsigned short* chain; // clusters of the sub directory
+        int entryCount;
+        int entryCapacity;
+        int indexSize;   // power of 2 (hash table size)
+        int* indexTable; // entry index + 1 (0: empty, -1: deleted)
+        struct Entry {
+            bool removed;
+            char displayName[16];
+            char name[9];
+            char ext[4];
+            bool dirent;
+            unsigned short cluster;
+            unsigned int size;
+            struct Attribute {
+                unsigned char raw;
+                bool dirent;
+                bool volumeLabel;
+                bool systemFile;
+                bool hidden;
+                bool readOnly;
+            } attr;
+            struct Date {
+                int year;
+                int month;
+                int day;
+                int hour;
+                int minute;
+                int second;
+            } date;
+            unsigned char dateRaw[4];
+            NameKey key;
+        }* entries;
+    };
+    typedef Directory::Entry Entry;
+
+    // Run of the continuous sectors of a file
+    struct Extent {
+        int sector; // first sector
+        int count;  // number of sectors
+    };
+
+    DiskImage();
+    ~DiskImage();
+    DiskImage(const DiskImage&) = delete;
+    DiskImage& operator=(const DiskImage&) = delete;
+
+    // Open the image file (writable: flush writes back through the opened descriptor)
+    bool open(const char* path, bool writable);
+
+    // Format a new image in memory (the file is made by flush)
+    bool create(const char* path, const Format& format);
+
+    // Discard the image (modifications not flushed are lost)
+    void close();
+
+    // Write back the modified sectors to the file
+    bool flush();
+
+    bool isOpened() const { return nullptr != image; }
+    bool isModified() const;
+    const char* getPath() const { return path; }
+
+    // Directory of the path (nullptr or empty: root directory)
+    Directory* openDirectory(const char* path);
+
+    // Sub directory of the i-th entry of the parent (parsed only on first access)
+    Directory* openSubDirectory(Directory* parent, int i);
+
+    // File entry of the path (directories are not found)
+    const Entry* findFile(const char* path);
+
+    // Index of the entry of the name (FILE.EXT) in the directory by the hashed index (-1: not found)
+    int findEntry(const Directory* d, const char* displayName);
+
+    // Change the date of the i-th entry of the directory (date: directory entry format)
+    bool setDate(Directory* d, int i, const unsigned char* date);
+
+    // Resolve the file into the extents by following the FAT chain from the first cluster
+    // (returns the number of the extents covering entry->size, and stores the first capacity extents)
+    int getExtents(const Entry* entry, Extent* extents, int capacity) const;
+
+    // Copy the content of the file (entry->size bytes, 1 copy per extent)
+    // - Fails with IOError if the cluster chain is shorter than entry->size
+    bool read(const Entry* entry, void* buffer);
+    bool read(const Entry* entry, FILE* fp);
+
+    // Write the file to the path (overwrite if exists, date: directory entry format or nullptr for now)
+    bool write(const char* path, const void* data, size_t size, const unsigned char* date = nullptr);
+
+    bool makeDirectory(const char* path);
+
+    // Remove the file or the empty directory
+    bool remove(const char* path);
+
+    // Move every cluster chain (files and sub directories) to a contiguous run from the top of the data area
+    // - The chains of the order entries are placed first, then the others in the directory order
+    // - Bad clusters and lost clusters (not referred from any directory) are not moved
+    bool defragment(const Entry* const* order = nullptr, int count = 0);
+
+    const BootSector& getBootSector() const { return boot; }
+    unsigned char getFatId() const { return fat.fatId; }
+    Directory* getRootDirectory() { return &dir; }
+    int getMaxCluster() const { return fat.clusterCount - 1; }
+    int getFatEntry(int cluster) const { return fat.next[cluster]; }
+    bool isChainCluster(int cluster) const { return 2 <= cluster && cluster <= getMaxCluster(); }
+    int getClusterBytes() const { return boot.clusterSize * boot.sectorSize; }
+    int countFreeCluster() const;
+
+    Error getError() const { return error; }
+    const char* getErrorMessage() const { return errorMessage; }
+
+    // Current local time in the format of the directory entry
+    static void getDate(unsigned char* date);
+
+    // Local time of t in the format of the directory entry (2 seconds resolution)
+    static void makeDate(time_t t, unsigned char* date);
+
+  private:
+    unsigned char (*image)[512];
+    char* path;
+
+    // Backend of image: private mmap of the image file (or heap for new/unmappable images)
+    struct ImageFile {
+        int fd;
+        bool mapped;
+        bool writable;        // fd is opened with O_RDWR
+        bool created;         // new image (write back from scratch)
+        size_t size;          // bytes
+        int sectorCount;      // size / 512
+        unsigned char* dirty; // sectors modified since load (1 bit per sector)
+    } imageFile;
+
+    BootSector boot;
+
+    struct FAT {
+        unsigned char fatId;
+        int clusterCount;     // number of FAT12 entries including the reserved #0 and #1
+        unsigned short* next; // next[cluster]: decoded FAT12 link (0: free, 0xFF8-0xFFF: end of chain)
+    } fat;
+
+    Directory dir; // root directory
+
+    // Parsed sub directories (index: first cluster)
+    Directory** dirCache;
+    int dirCacheSize;
+
+    Error error;
+    const char* errorMessage;
+
+    bool fail(Error error, const char* message);
+    void markDirty(const void* ptr, size_t size);
+    bool isDirty(int sector) const;
+    bool allocateDirtyMap(int sectorCount);
+    bool setPath(const char* path);
+
+    void extractBootSectorFromDisk();
+    void extractBootSectorToDisk();
+    void setupBootSector(const Format* format);
+    bool isValidBootSector(size_t size) const;
+    bool extractFatFromDisk();
+    void setFatEntry(int cluster, int value);
+    unsigned char* getClusterPointer(int cluster) const;
+    Extent* resolveExtents(const Entry* entry, Extent* buffer, int capacity, int* count) const;
+    void releaseClusterChain(int cluster);
+    int findFreeCluster() const;
+
+    unsigned char* getDirectoryEntryPointer(const Directory* d, int i) const;
+    void addDirectoryIndex(Directory* d, int i);
+    void removeDirectoryIndex(Directory* d, int i);
+    int findDirectoryEntry(const Directory* d, const char* name, const char* ext) const;
+    void updateDirectoryEntry(Directory* d, int i);
+    bool reserveDirectory(Directory* d, int capacity);
+    bool extractDirectory(Directory* d);
+    void freeDirectory(Directory* d);
+    void clearDirectoryCache();
+    bool extractDirectoryFromDisk();
+    Directory* changeDirectory(Directory* d, char* component);
+    Directory* resolveDirectory(char* path, char** fileName);
+    bool parseDisplayName(char* displayName, char* name, char* ext);
+    int findFreeSlot(const Directory* d) const;
+    bool extendDirectory(Directory* d);
+    void writeDirectoryEntry(unsigned char* ptr, const char* name, const char* ext, unsigned char attr, const unsigned char* date, unsigned short cluster, unsigned int size);
+    bool collectChains(Directory* d, unsigned short* starts, int* startCount, unsigned char* owner);
+    void relocateDirectory(int cluster, const unsigned short* map);
+};
+
+#endif // INCLUDE_DISKIMAGE_HPP
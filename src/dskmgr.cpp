@@ -25,97 +25,33 @@
  * -----------------------------------------------------------------------------
  */
 #include "basic.hpp"
+#include "basiccache.hpp"
+#include "diskcommand.hpp"
+#include "diskimage.hpp"
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
 
-#define MAX_FILES 112
-
-static BasicFilter bf;
-static unsigned char diskImage[1440][512];
-
-// NOTE: Boundary-unaware data structure to be expanded at read time
-static struct BootSector {
-    unsigned char bootJump[3];
-    unsigned char oemName[9];
-    unsigned short sectorSize;
-    unsigned char clusterSize;
-    unsigned short fatPosition;
-    unsigned char fatCopy;
-    unsigned short directoryEntry;
-    unsigned short numberOfSector;
-    unsigned char mediaId; // F8: Fixed Media, F0: Removal Media
-    unsigned short fatSize;
-    unsigned short sectorPerTrack;
-    unsigned short diskSides;
-    unsigned short hiddenSector;
-    unsigned char bootJump2[2];
-    unsigned char idLabel[7];
-    unsigned char dirtyFlag;
-    unsigned char idValue[4];
-    unsigned char reserved[5];
-    unsigned char bootProgram[0x1D0];
-    int directoryPosition;
-    int dataPosition;
-} boot;
-
-static struct FAT {
-    unsigned char fatId;
-    int entryCount;
-    struct Entry {
-        int clusterCount;
-        unsigned short cluster[2048];
-    } entries[1440];
-} fat;
-
-static struct Directory {
-    int entryCount;
-    struct Entry {
-        bool removed;
-        char displayName[16];
-        char name[9];
-        char ext[4];
-        bool dirent;
-        unsigned short cluster;
-        unsigned int size;
-        struct Attribute {
-            unsigned char raw;
-            bool dirent;
-            bool volumeLabel;
-            bool systemFile;
-            bool hidden;
-            bool readOnly;
-        } attr;
-        struct Date {
-            int year;
-            int month;
-            int day;
-            int hour;
-            int minute;
-            int second;
-        } date;
-        unsigned char dateRaw[4];
-    } entries[128];
-} dir;
-
-static struct CreateFileInfo {
-    int entryCount;
-    struct Entry {
-        char name[8];
-        char ext[3];
-        unsigned char date[4];
-        unsigned int size;
-        void* data;
-        int sectorSize;
-        int clusterSize;
-        unsigned short clusterStart;
-    } entries[MAX_FILES];
-    int totalCluster;
-    int totalSector;
-    int totalSize;
-} cfi;
+static DiskImage disk;
+static BasicCache basicCache; // --cache-dir (or DSKMGR_CACHE_DIR)
 
 static bool isLittleEndian()
 {
@@ -130,766 +66,1050 @@ static bool isLittleEndian()
 #define BIT_WR 0b00010000
 #define BIT_CAT 0b00100000
 #define BIT_RM 0b01000000
+#define BIT_BATCH 0b10000000
+#define BIT_MKDIR 0b100000000
+#define BIT_EXTRACT 0b1000000000
+#define BIT_SERVE 0b10000000000
+#define BIT_SYNC 0b100000000000
+#define BIT_DEFRAG 0b1000000000000
+#define BIT_ALL 0b1111111111111
 
 static void showUsage(int bit)
 {
     puts("usage:");
-    if (bit & BIT_CREATE) puts("- create .......... dskmgr image.dsk create [files]");
+    if (bit & BIT_CREATE) puts("- create .......... dskmgr image.dsk create [-f 1DD|2DD|2HD|sectors,cluster,dirent[,media]] [-j jobs] [--cache-dir dir] [files]");
     if (bit & BIT_INFO) puts("- information ..... dskmgr image.dsk info");
-    if (bit & BIT_LS) puts("- list files ...... dskmgr image.dsk ls");
+    if (bit & BIT_LS) puts("- list files ...... dskmgr image.dsk ls [directory]");
     if (bit & BIT_CP) puts("- copy to local ... dskmgr image.dsk get filename [as filename2]");
     if (bit & BIT_WR) puts("- copy to disk .... dskmgr image.dsk put filename [as filename2]");
     if (bit & BIT_CAT) puts("- stdout file  .... dskmgr image.dsk cat filename");
     if (bit & BIT_RM) puts("- remove file  .... dskmgr image.dsk rm filename");
+    if (bit & BIT_MKDIR) puts("- make directory .. dskmgr image.dsk mkdir directory");
+    if (bit & BIT_EXTRACT) puts("- extract all .... dskmgr image.dsk extract outdir [--text-bas] [-j jobs]");
+    if (bit & BIT_SYNC) puts("- sync ........... dskmgr image.dsk sync hostdir [--delete]");
+    if (bit & BIT_DEFRAG) puts("- defragment ..... dskmgr image.dsk defrag [--order name|size|list.txt]");
+    if (bit & BIT_BATCH) puts("- batch .......... dskmgr image.dsk batch script.txt (or - for stdin)");
+    if (bit & BIT_SERVE) puts("- serve .......... dskmgr serve --socket path [--cache images] [--idle seconds] [--cache-dir dir]");
+}
+
+// Print the reason of the last failed disk operation and return the exit code
+static int diskError(int code)
+{
+    return DiskCommand::diskError(&disk, code);
+}
+
+static int diskWriteError()
+{
+    return DiskCommand::diskWriteError(&disk);
+}
+
+static bool loadDisk(const char* dsk, bool writable)
+{
+    if (disk.isOpened()) return true;
+    if (!disk.open(dsk, writable)) {
+        puts(disk.getErrorMessage());
+        return false;
+    }
+    return true;
 }
 
-static const unsigned char* now()
+struct ExtractJob {
+    const DiskImage::Entry* entry;
+    char* path;    // local file path
+    bool textBas;  // convert to the text format
+    bool failed;
+};
+
+// Collect the files of the directory (and the sub directories) and make the local directories
+static bool collectExtractJobs(DiskImage::Directory* d, const char* localDir, bool textBas, std::vector<ExtractJob>& jobs, std::vector<bool>& visited)
 {
-    static unsigned char buf[4] = {0, 0, 0, 0};
-    if (0 == buf[0] && 0 == buf[1] && 0 == buf[2] && 0 == buf[3]) {
-        time_t t1 = time(nullptr);
-        struct tm* t2 = localtime(&t1);
-        buf[0] = (t2->tm_min & 0b00000111) << 5;
-        buf[0] |= (t2->tm_sec & 0b00111110) >> 1;
-        buf[1] = (t2->tm_hour & 0b00011111) << 3;
-        buf[1] |= (t2->tm_min & 0b00111000) >> 3;
-        buf[2] = ((t2->tm_mon + 1) & 0b00000111) << 5;
-        buf[2] |= (t2->tm_mday) & 0b00011111;
-        buf[3] = ((t2->tm_year - 80) & 0b01111111) << 1;
-        buf[3] |= ((t2->tm_mon + 1) & 0b00001000) >> 3;
+    if (0 != ::mkdir(localDir, 0755) && EEXIST != errno) {
+        printf("I/O error: %s\n", localDir);
+        return false;
+    }
+    for (int i = 0; i < d->entryCount; i++) {
+        const DiskImage::Entry* e = &d->entries[i];
+        if (e->removed || e->attr.volumeLabel || '.' == e->name[0]) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", localDir, e->displayName);
+        if (e->attr.dirent) {
+            // 壊れたディスクで親ディレクトリを指している場合に備えて1度だけ辿る
+            DiskImage::Directory* sub = disk.openSubDirectory(d, i);
+            if (!sub || visited[sub->cluster]) continue;
+            visited[sub->cluster] = true;
+            if (!collectExtractJobs(sub, path, textBas, jobs, visited)) return false;
+            continue;
+        }
+        ExtractJob job = {e, strdup(path), textBas && 0 == strcmp(e->ext, "BAS"), false};
+        jobs.push_back(job);
     }
-    return buf;
+    return true;
 }
 
-static void extractDirectoryFromDisk()
+// Write a file to local (thread safe: reads the disk image only)
+static void extractFile(ExtractJob* job)
 {
-    memset(&dir, 0, sizeof(dir));
-    //unsigned char* ptr = diskImage[boot.fatPosition + boot.fatSize * boot.fatCopy];
-    unsigned char* ptr = diskImage[boot.directoryPosition];
-    while (*ptr) {
-        if (0xE5 == *ptr) {
-            dir.entries[dir.entryCount].removed = true;
-            ptr += 32;
+    const DiskImage::Entry* e = job->entry;
+    FILE* fp = fopen(job->path, "wb");
+    if (!fp) {
+        job->failed = true;
+        return;
+    }
+    if (job->textBas) {
+        // 中間言語形式 (先頭が 0xFF) の場合のみテキストに変換
+        unsigned char* buf = (unsigned char*)calloc(1, e->size + 3);
+        if (!buf) {
+            job->failed = true;
         } else {
-            dir.entries[dir.entryCount].removed = false;
-            memcpy(dir.entries[dir.entryCount].name, ptr, 8);
-            ptr += 8;
-            memcpy(dir.entries[dir.entryCount].ext, ptr, 3);
-            ptr += 3;
-            dir.entries[dir.entryCount].attr.raw = *ptr;
-            dir.entries[dir.entryCount].attr.dirent = (*ptr) & 0b00010000 ? true : false;
-            dir.entries[dir.entryCount].attr.volumeLabel = (*ptr) & 0b00001000 ? true : false;
-            dir.entries[dir.entryCount].attr.systemFile = (*ptr) & 0b00000100 ? true : false;
-            dir.entries[dir.entryCount].attr.systemFile = (*ptr) & 0b00000100 ? true : false;
-            dir.entries[dir.entryCount].attr.hidden = (*ptr) & 0b00000010 ? true : false;
-            dir.entries[dir.entryCount].attr.readOnly = (*ptr) & 0b00000001 ? true : false;
-            ptr += 11;
-            memcpy(dir.entries[dir.entryCount].dateRaw, ptr, 4);
-            dir.entries[dir.entryCount].date.minute = ((*ptr) & 0b11100000) >> 5;
-            dir.entries[dir.entryCount].date.second = ((*ptr) & 0b00011111) << 1;
-            ptr++;
-            dir.entries[dir.entryCount].date.hour = ((*ptr) & 0b11111000) >> 3;
-            dir.entries[dir.entryCount].date.minute += ((*ptr) & 0b00000111) << 3;
-            ptr++;
-            dir.entries[dir.entryCount].date.month = ((*ptr) & 0b11100000) >> 5;
-            dir.entries[dir.entryCount].date.day = (*ptr) & 0b00011111;
-            ptr++;
-            dir.entries[dir.entryCount].date.year = 1980 + (((*ptr) & 0b11111110) >> 1);
-            dir.entries[dir.entryCount].date.month += ((*ptr) & 0b00000001) << 3;
-            ptr++;
-            memcpy(&dir.entries[dir.entryCount].cluster, ptr, 2);
-            ptr += 2;
-            memcpy(&dir.entries[dir.entryCount].size, ptr, 4);
-            ptr += 4;
-            strcpy(dir.entries[dir.entryCount].displayName, dir.entries[dir.entryCount].name);
-            for (int i = strlen(dir.entries[dir.entryCount].displayName) - 1; 0 <= i; i--) {
-                if (' ' == dir.entries[dir.entryCount].displayName[i]) {
-                    dir.entries[dir.entryCount].displayName[i] = 0;
-                } else
-                    break;
+            if (!disk.read(e, buf)) {
+                job->failed = true;
+            } else if (0xFF == buf[0]) {
+                BasicFilter filter;
+                filter.bas2txt(fp, buf);
+            } else {
+                fwrite(buf, 1, e->size, fp);
             }
-            if (dir.entries[dir.entryCount].ext[0] != 0 && dir.entries[dir.entryCount].ext[1] != ' ') {
-                strcat(dir.entries[dir.entryCount].displayName, ".");
-                strcat(dir.entries[dir.entryCount].displayName, dir.entries[dir.entryCount].ext);
+            free(buf);
+        }
+    } else {
+        if (!disk.read(e, fp)) job->failed = true;
+    }
+    if (0 != fclose(fp)) job->failed = true;
+}
+
+static int extract(const char* outdir, bool textBas, int jobCount)
+{
+    std::vector<ExtractJob> jobs;
+    std::vector<bool> visited(disk.getMaxCluster() + 1);
+    bool result = collectExtractJobs(disk.getRootDirectory(), outdir, textBas, jobs, visited);
+    if (result) {
+        // 先頭クラスタ順に書き出してディスクイメージを先頭から順に読む
+        std::stable_sort(jobs.begin(), jobs.end(), [](const ExtractJob& a, const ExtractJob& b) { return a.entry->cluster < b.entry->cluster; });
+        std::atomic<size_t> next(0);
+        auto worker = [&]() {
+            for (size_t i = next++; i < jobs.size(); i = next++) {
+                extractFile(&jobs[i]);
             }
+        };
+        std::vector<std::thread> threads;
+        for (int i = 1; i < jobCount && (size_t)i < jobs.size(); i++) {
+            threads.emplace_back(worker);
         }
-        dir.entryCount++;
+        worker();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    for (auto& job : jobs) {
+        if (job.failed) {
+            printf("I/O error: %s\n", job.path);
+            result = false;
+        }
+        free(job.path);
     }
+    return result ? 0 : 6;
 }
 
-static void extractFatFromDisk()
+// Load the local files with the worker threads, then write them in the argument order
+static bool writeLocalFiles(char** paths, int count, int jobs)
 {
-    memset(&fat, 0, sizeof(fat));
-    int fatSize = boot.fatSize * boot.sectorSize;
-    unsigned char* ptr = diskImage[boot.fatPosition];
-    fat.fatId = ptr[0];
-    if (ptr[1] != 0xFF) return;
-    if (ptr[2] != 0xFF) return;
-    ptr += 3;
-    fatSize -= 3;
-    fat.entryCount = 1;
-    unsigned short* data = (unsigned short*)malloc(fatSize / 3 * 2 * 2);
-    if (!data) {
+    DiskCommand::LocalFile* files = (DiskCommand::LocalFile*)calloc(count ? count : 1, sizeof(DiskCommand::LocalFile));
+    if (!files) {
         puts("No memory");
-        exit(-1);
-    }
-    int dataIndex = 0;
-    while (0 < fatSize) {
-        if (0 == (dataIndex & 1)) {
-            unsigned short s = *ptr;
-            data[dataIndex] = s;
-            ptr++;
-            fatSize--;
-            s = *ptr;
-            data[dataIndex] |= (s & 0x0F) << 8;
-        } else {
-            unsigned short s = *ptr;
-            data[dataIndex] = (s & 0xF0) >> 4;
-            ptr++;
-            fatSize--;
-            s = *ptr;
-            data[dataIndex] |= s << 4;
-            ptr++;
-            fatSize--;
-        }
-        dataIndex++;
-    }
-    for (int i = 0; i < dataIndex; i++) {
-        if (data[i] != 0x0FFF) {
-            fat.entries[fat.entryCount].cluster[fat.entries[fat.entryCount].clusterCount++] = data[i];
-        } else {
-            fat.entryCount++;
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        files[i].path = paths[i];
+    }
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++) {
+            DiskCommand::loadLocalFile(&files[i], &basicCache);
         }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < jobs && i < count; i++) {
+        threads.emplace_back(worker);
     }
-    free(data);
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    // クラスタとディレクトリエントリの割り当ては引数の順番で行う (スレッド数に依らず同一のイメージになる)
+    bool result = true;
+    for (int i = 0; i < count; i++) {
+        if (result) {
+            char name[13];
+            DiskCommand::makeShortName(DiskCommand::getFileName(files[i].path), name);
+            result = DiskCommand::writeLocalFile(&disk, &files[i], name, nullptr);
+        }
+        free(files[i].data);
+    }
+    free(files);
+    return result;
 }
 
-static void extractBootSectorFromDisk()
-{
-    memset(&boot, 0, sizeof(boot));
-    memcpy(&boot.bootJump, &diskImage[0][0x00], 3);
-    memcpy(&boot.oemName, &diskImage[0][0x03], 8);
-    memcpy(&boot.sectorSize, &diskImage[0][0xB], 2);
-    memcpy(&boot.clusterSize, &diskImage[0][0xD], 1);
-    memcpy(&boot.fatPosition, &diskImage[0][0xE], 2);
-    memcpy(&boot.fatCopy, &diskImage[0][0x10], 1);
-    memcpy(&boot.directoryEntry, &diskImage[0][0x11], 2);
-    memcpy(&boot.numberOfSector, &diskImage[0][0x13], 2);
-    memcpy(&boot.mediaId, &diskImage[0][0x15], 1);
-    memcpy(&boot.fatSize, &diskImage[0][0x16], 2);
-    memcpy(&boot.sectorPerTrack, &diskImage[0][0x18], 2);
-    memcpy(&boot.diskSides, &diskImage[0][0x1A], 2);
-    memcpy(&boot.hiddenSector, &diskImage[0][0x1C], 2);
-    memcpy(&boot.bootJump2, &diskImage[0][0x1E], 2);
-    memcpy(&boot.idLabel, &diskImage[0][0x20], 6);
-    memcpy(&boot.dirtyFlag, &diskImage[0][0x26], 1);
-    memcpy(&boot.idValue, &diskImage[0][0x27], 4);
-    memcpy(&boot.reserved, &diskImage[0][0x2B], 5);
-    memcpy(&boot.bootProgram, &diskImage[0][0x30], sizeof(boot.bootProgram));
-    boot.directoryPosition = boot.fatPosition + boot.fatSize * boot.fatCopy;
-    boot.dataPosition = boot.directoryPosition + 5;
-}
-
-static void extractBootSectorToDisk()
-{
-    memcpy(&diskImage[0][0x00], &boot.bootJump, 3);
-    memcpy(&diskImage[0][0x03], &boot.oemName, 8);
-    memcpy(&diskImage[0][0xB], &boot.sectorSize, 2);
-    memcpy(&diskImage[0][0xD], &boot.clusterSize, 1);
-    memcpy(&diskImage[0][0xE], &boot.fatPosition, 2);
-    memcpy(&diskImage[0][0x10], &boot.fatCopy, 1);
-    memcpy(&diskImage[0][0x11], &boot.directoryEntry, 2);
-    memcpy(&diskImage[0][0x13], &boot.numberOfSector, 2);
-    memcpy(&diskImage[0][0x15], &boot.mediaId, 1);
-    memcpy(&diskImage[0][0x16], &boot.fatSize, 2);
-    memcpy(&diskImage[0][0x18], &boot.sectorPerTrack, 2);
-    memcpy(&diskImage[0][0x1A], &boot.diskSides, 2);
-    memcpy(&diskImage[0][0x1C], &boot.hiddenSector, 2);
-    memcpy(&diskImage[0][0x1E], &boot.bootJump2, 2);
-    memcpy(&diskImage[0][0x20], &boot.idLabel, 6);
-    memcpy(&diskImage[0][0x26], &boot.dirtyFlag, 1);
-    memcpy(&diskImage[0][0x27], &boot.idValue, 4);
-    memcpy(&diskImage[0][0x2B], &boot.reserved, 5);
-    memcpy(&diskImage[0][0x30], &boot.bootProgram, 0x1D0);
-    boot.directoryPosition = boot.fatPosition + boot.fatSize * boot.fatCopy;
-    boot.dataPosition = boot.directoryPosition + 5;
-}
-
-static bool readDisk(const char* dsk)
-{
-    FILE* fp = fopen(dsk, "rb");
-    if (!fp) return false;
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    if (size != sizeof(diskImage)) {
-        puts("Unsupported file size (not 720KB)");
-        fclose(fp);
+static int create(const char* dskPath, const DiskImage::Format& format, char** paths, int count, int jobs)
+{
+    if (!disk.create(dskPath, format)) return diskError(-1);
+    if (!writeLocalFiles(paths, count, jobs)) return 5;
+    return disk.flush() ? 0 : diskError(6);
+}
+
+// Host file (or directory) to be synchronized with the 8.3 name on the disk
+struct SyncItem {
+    std::string hostPath;
+    char name[13];
+    struct stat st;
+};
+
+struct SyncCount {
+    int added;
+    int updated;
+    int removed;
+    int unchanged;
+    int compared; // existing files read to compare the content
+};
+
+// Regular files and directories of the host directory in the name order (hidden files are ignored)
+static bool listSyncItems(const char* hostDir, std::vector<SyncItem>& items)
+{
+    DIR* dp = opendir(hostDir);
+    if (!dp) {
+        printf("Directory not found: %s\n", hostDir);
         return false;
     }
-    fseek(fp, 0, SEEK_SET);
-    if (size != fread(diskImage, 1, size, fp)) {
-        puts("I/O error");
-        fclose(fp);
-        return false;
+    for (struct dirent* de = readdir(dp); de; de = readdir(dp)) {
+        if ('.' == de->d_name[0]) continue;
+        SyncItem item;
+        item.hostPath = std::string(hostDir) + "/" + de->d_name;
+        if (0 != stat(item.hostPath.c_str(), &item.st) || (!S_ISREG(item.st.st_mode) && !S_ISDIR(item.st.st_mode))) continue;
+        DiskCommand::makeShortName(de->d_name, item.name);
+        for (char* cp = item.name; *cp; cp++) *cp = toupper(*cp);
+        items.push_back(item);
     }
-    fclose(fp);
-    extractBootSectorFromDisk();
-    extractFatFromDisk();
-    extractDirectoryFromDisk();
+    closedir(dp);
+    std::sort(items.begin(), items.end(), [](const SyncItem& a, const SyncItem& b) { return a.hostPath < b.hostPath; });
     return true;
 }
 
-static int info(const char* dsk)
-{
-    if (!readDisk(dsk)) return 2;
-    puts("[Boot Sector]");
-    printf("            OEM: %s\n", boot.oemName);
-    printf("       Media ID: 0x%02X\n", boot.mediaId);
-    printf("    Sector Size: %d bytes\n", boot.sectorSize);
-    printf("  Total Sectors: %d\n", boot.numberOfSector);
-    printf("   Cluster Size: %d bytes (%d sectors)\n", boot.clusterSize * boot.sectorSize, boot.clusterSize);
-    printf("   FAT Position: %d\n", boot.fatPosition);
-    printf("       FAT Size: %d bytes (%d sectors)\n", boot.fatSize * boot.sectorSize, boot.fatSize);
-    printf("       FAT Copy: %d\n", boot.fatCopy);
-    printf("Creatable Files: %d\n", boot.directoryEntry);
-    printf("        Sectors: %d per track\n", boot.sectorPerTrack);
-    printf("     Disk Sides: %d\n", boot.diskSides);
-    printf(" Hidden Sectors: %d\n", boot.hiddenSector);
-    if (0 == memcmp(boot.idLabel, "VOL_ID", 6)) {
-        printf("      Volume ID: %02X,%02X,%02X,%02X\n", boot.idValue[0], boot.idValue[1], boot.idValue[2], boot.idValue[3]);
-    }
-    printf("     Dirty Flag: %02X\n", boot.dirtyFlag);
-    puts("\n[FAT]");
-    printf("Fat ID: 0x%02X\n", fat.fatId);
-    int usingCluster = 1;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (!dir.entries[i].removed) {
-            printf("- dirent#%d (%s) ... %d", i, dir.entries[i].displayName, dir.entries[i].cluster);
-            usingCluster++;
-            for (int j = 0; j < fat.entries[i + 1].clusterCount; j++) {
-                printf(",%d", fat.entries[i + 1].cluster[j]);
-                usingCluster++;
+// Entry of the 8.3 name by the directory index (volume labels are not found)
+static int findSyncEntry(DiskImage::Directory* d, const char* name)
+{
+    int i = disk.findEntry(d, name);
+    return 0 <= i && !d->entries[i].attr.volumeLabel ? i : -1;
+}
+
+// Mark the entry as synchronized with a host file (not removed by --delete)
+static void markSyncEntry(std::vector<bool>& synced, int i)
+{
+    if (i < 0) return;
+    if ((int)synced.size() <= i) synced.resize(i + 1);
+    synced[i] = true;
+}
+
+// Remove the file or the directory with all files in it
+static bool removeTree(const std::string& path, bool directory)
+{
+    if (directory) {
+        DiskImage::Directory* d = disk.openDirectory(path.c_str());
+        if (!d) return false;
+        for (int i = 0; i < d->entryCount; i++) {
+            const DiskImage::Entry* e = &d->entries[i];
+            if (e->removed || e->attr.volumeLabel || '.' == e->name[0]) continue;
+            if (!removeTree(path + "/" + e->displayName, e->attr.dirent)) return false;
+        }
+    }
+    return disk.remove(path.c_str());
+}
+
+// Whether the disk file has the same content as the loaded host file
+static bool isSameContent(const DiskImage::Entry* e, const DiskCommand::LocalFile* file)
+{
+    if (e->size != file->size) return false;
+    unsigned char* buf = (unsigned char*)malloc(e->size ? e->size : 1);
+    if (!buf) return false;
+    bool result = disk.read(e, buf) && 0 == memcmp(buf, file->data, e->size);
+    free(buf);
+    return result;
+}
+
+// Synchronize the disk directory (diskDir: "" or "A/B/") with the host directory
+static int syncDirectory(const char* hostDir, const std::string& diskDir, bool deleteMissing, time_t syncedAt, SyncCount* count)
+{
+    std::vector<SyncItem> items;
+    if (!listSyncItems(hostDir, items)) return 5;
+    DiskImage::Directory* d = disk.openDirectory(diskDir.empty() ? nullptr : diskDir.c_str());
+    if (!d) return diskError(4);
+    std::vector<bool> synced; // entries of the host files (index: entry)
+    for (auto& item : items) {
+        std::string target = diskDir + item.name;
+        int i = findSyncEntry(d, item.name);
+        if (0 <= i && i < (int)synced.size() && synced[i]) {
+            printf("%s: Skip (same 8.3 name as the previous file)\n", item.hostPath.c_str());
+            continue;
+        }
+        bool exists = 0 <= i;
+        if (S_ISDIR(item.st.st_mode)) {
+            if (exists && !d->entries[i].attr.dirent) {
+                if (!disk.remove(target.c_str())) return diskWriteError();
+                exists = false;
+            }
+            if (!exists) {
+                if (!disk.makeDirectory(target.c_str())) return diskWriteError();
+                printf("%s: Make directory %s\n", item.hostPath.c_str(), target.c_str());
+                count->added++;
             }
-            printf("\n");
+            markSyncEntry(synced, findSyncEntry(d, item.name));
+            int result = syncDirectory(item.hostPath.c_str(), target + "/", deleteMissing, syncedAt, count);
+            if (result) return result;
+            continue;
+        }
+        // 日時 (書き込み時にローカルの更新日時を設定) とサイズが同じであればファイルを読まずに未変更とみなす
+        // - テキスト形式の .BAS は変換後のサイズが異なるため日時のみで判定
+        // - 日時は2秒単位のため、前回の書き込みの直前以降に更新されたファイルは内容を比較する
+        unsigned char date[4];
+        DiskImage::makeDate(item.st.st_mtime, date);
+        if (exists && d->entries[i].attr.dirent) {
+            if (!removeTree(target, true)) return diskWriteError();
+            exists = false;
+        }
+        if (exists && item.st.st_mtime + 2 < syncedAt && 0 == memcmp(d->entries[i].dateRaw, date, 4) && (DiskCommand::isBasicFileName(item.name) || d->entries[i].size == (unsigned int)item.st.st_size)) {
+            markSyncEntry(synced, i);
+            count->unchanged++;
+            continue;
+        }
+        DiskCommand::LocalFile file;
+        memset(&file, 0, sizeof(file));
+        file.path = item.hostPath.c_str();
+        DiskCommand::loadLocalFile(&file, &basicCache);
+        if (exists) count->compared++;
+        if (0 == file.error && exists && isSameContent(&d->entries[i], &file)) {
+            free(file.data);
+            // 次回は内容を読まずに判定できるように日時のみ更新する (ディレクトリのセクタのみ書き換え)
+            if (!disk.setDate(d, i, date)) return diskWriteError();
+            markSyncEntry(synced, i);
+            count->unchanged++;
+            continue;
+        }
+        bool result = DiskCommand::writeLocalFile(&disk, &file, target.c_str(), target.c_str(), date);
+        free(file.data);
+        if (!result) return 0 != file.error ? -1 : diskWriteError();
+        markSyncEntry(synced, findSyncEntry(d, item.name));
+        if (exists) {
+            count->updated++;
+        } else {
+            count->added++;
+        }
+    }
+    if (deleteMissing) {
+        for (int i = 0; i < d->entryCount; i++) {
+            const DiskImage::Entry* e = &d->entries[i];
+            if (e->removed || e->attr.volumeLabel || '.' == e->name[0]) continue;
+            if (i < (int)synced.size() && synced[i]) continue;
+            std::string target = diskDir + e->displayName;
+            if (!removeTree(target, e->attr.dirent)) return diskWriteError();
+            printf("%s: Removed\n", target.c_str());
+            count->removed++;
         }
     }
-    printf("Total using cluster: %d (%d bytes)\n", usingCluster, usingCluster * boot.clusterSize * boot.sectorSize);
     return 0;
 }
 
-static int ls(const char* dsk)
+static int syncHostDirectory(const char* hostDir, bool deleteMissing)
 {
-    if (!readDisk(dsk)) return 2;
-    int totalSize = 0;
-    int totalCluster = 0;
-    int fileCount = 0;
-    int cs = boot.sectorSize * boot.clusterSize;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (dir.entries[i].removed) continue;
-        printf("%02X:%c%c%c%c%c  %-12s  %8u bytes  %4d.%02d.%02d %02d:%02d:%02d  (C:%d, S:%d)\n", dir.entries[i].attr.raw, dir.entries[i].attr.dirent ? 'd' : '-', dir.entries[i].attr.volumeLabel ? 'v' : '-', dir.entries[i].attr.systemFile ? 's' : '-', dir.entries[i].attr.hidden ? 'h' : '-', dir.entries[i].attr.readOnly ? '-' : 'w', dir.entries[i].displayName, dir.entries[i].size, dir.entries[i].date.year, dir.entries[i].date.month, dir.entries[i].date.day, dir.entries[i].date.hour, dir.entries[i].date.minute, dir.entries[i].date.second, dir.entries[i].cluster, boot.dataPosition + (dir.entries[i].cluster - 1) * boot.clusterSize);
-        totalSize += dir.entries[i].size;
-        totalCluster += dir.entries[i].size / cs + (dir.entries[i].size % cs ? 1 : 0);
-        fileCount++;
+    SyncCount count = {0, 0, 0, 0, 0};
+    struct stat st;
+    time_t syncedAt = 0 == stat(disk.getPath(), &st) ? st.st_mtime : 0; // 前回ディスクイメージを書き込んだ日時
+    int result = syncDirectory(hostDir, "", deleteMissing, syncedAt, &count);
+    if (0 == result) {
+        printf("Sync: %d added, %d updated, %d removed, %d unchanged (%d compared by content)\n", count.added, count.updated, count.removed, count.unchanged, count.compared);
     }
-    if (0 < fileCount) {
-        int freeCluster = ((boot.numberOfSector - (boot.dataPosition + 2)) / boot.clusterSize) - totalCluster;
-        printf("Total Size: %7d bytes\n", totalSize);
-        printf(" Free Size: %7d bytes (%d clusters)\n", cs * freeCluster, freeCluster);
+    return result;
+}
+
+struct FragmentCount {
+    int files;      // files and sub directories that have clusters
+    int fragmented; // files not stored in the continuous clusters
+    int fragments;  // continuous runs of clusters of all files
+};
+
+static void countFragments(DiskImage::Directory* d, FragmentCount* count, std::vector<bool>& visited)
+{
+    for (int i = 0; i < d->entryCount; i++) {
+        const DiskImage::Entry* e = &d->entries[i];
+        if (e->removed || '.' == e->name[0] || !disk.isChainCluster(e->cluster)) continue;
+        int fragments = 1;
+        int c = e->cluster;
+        for (int n = 0; n < disk.getMaxCluster(); n++) {
+            int next = disk.getFatEntry(c);
+            if (!disk.isChainCluster(next)) break;
+            if (next != c + 1) fragments++;
+            c = next;
+        }
+        count->files++;
+        count->fragments += fragments;
+        if (1 < fragments) count->fragmented++;
+        if (e->attr.dirent && !visited[e->cluster]) {
+            visited[e->cluster] = true;
+            DiskImage::Directory* sub = disk.openSubDirectory(d, i);
+            if (sub) countFragments(sub, count, visited);
+        }
     }
-    return 0;
 }
 
-static void wm(FILE* fp, unsigned char* buf, int di)
+static void printFragments(const char* label)
 {
-    int size = dir.entries[di].size;
-    // 最初のクラスタをディレクトリエントリから出力
-    for (int i = 0; 0 < size && i < boot.clusterSize; i++) {
-        int sector = boot.dataPosition;
-        sector += (dir.entries[di].cluster - 1) * boot.clusterSize;
-        sector += i;
-        int n = size < boot.sectorSize ? size : boot.sectorSize;
-        if (fp) {
-            fwrite(diskImage[sector], 1, n, fp);
-        }
-        if (buf) {
-            memcpy(buf, diskImage[sector], n);
-            buf += n;
-        }
-        size -= n;
-    }
-    // 2番目以降のクラスとをFATから出力
-    for (int ii = 0; 0 < size && ii < fat.entries[di + 1].clusterCount; ii++) {
-        for (int i = 0; 0 < size && i < boot.clusterSize; i++) {
-            int sector = boot.dataPosition;
-            sector += (fat.entries[di + 1].cluster[ii] - 1) * boot.clusterSize;
-            sector += i;
-            int n = size < boot.sectorSize ? size : boot.sectorSize;
-            if (fp) {
-                fwrite(diskImage[sector], 1, n, fp);
-            }
-            if (buf) {
-                memcpy(buf, diskImage[sector], n);
-                buf += n;
-            }
-            size -= n;
+    FragmentCount count = {0, 0, 0};
+    std::vector<bool> visited(disk.getMaxCluster() + 1);
+    countFragments(disk.getRootDirectory(), &count, visited);
+    printf("%s: %d of %d files fragmented (%d fragments)\n", label, count.fragmented, count.files, count.fragments);
+}
+
+// Entries of the directory and the sub directories (pre-order, sorted by the name in each directory if byName)
+static void collectDefragEntries(DiskImage::Directory* d, bool byName, std::vector<const DiskImage::Entry*>& entries, std::vector<bool>& visited)
+{
+    std::vector<int> indexes;
+    for (int i = 0; i < d->entryCount; i++) {
+        const DiskImage::Entry* e = &d->entries[i];
+        if (!e->removed && '.' != e->name[0] && disk.isChainCluster(e->cluster)) indexes.push_back(i);
+    }
+    if (byName) {
+        std::stable_sort(indexes.begin(), indexes.end(), [d](int a, int b) { return strcmp(d->entries[a].displayName, d->entries[b].displayName) < 0; });
+    }
+    for (int i : indexes) {
+        const DiskImage::Entry* e = &d->entries[i];
+        entries.push_back(e);
+        if (e->attr.dirent && !visited[e->cluster]) {
+            visited[e->cluster] = true;
+            DiskImage::Directory* sub = disk.openSubDirectory(d, i);
+            if (sub) collectDefragEntries(sub, byName, entries, visited);
         }
     }
 }
 
-static int parseDisplayName(char* displayName, char* name, char* ext)
+// Entries of the files (or directories) listed in the text file (1 path per line)
+static int loadDefragList(const char* listPath, std::vector<const DiskImage::Entry*>& entries)
 {
-    if (16 <= strlen(displayName)) {
-        puts("File not found (invalid length)");
-        return 4;
+    FILE* fp = fopen(listPath, "r");
+    if (!fp) {
+        printf("File not found: %s\n", listPath);
+        return 5;
     }
-    char* cp = strchr(displayName, '.');
-    if (cp) {
-        *cp = 0;
-        cp++;
-        if (3 < strlen(cp)) {
-            puts("File not found (invalid ext length)");
-            return 4;
+    char line[4096];
+    int result = 0;
+    while (0 == result && fgets(line, sizeof(line), fp)) {
+        char* path = strtok(line, "\r\n");
+        if (!path || '#' == *path) continue;
+        const DiskImage::Entry* e = disk.findFile(path);
+        if (!e && DiskImage::IsDirectory == disk.getError()) {
+            // ディレクトリは親ディレクトリのエントリを探す
+            const DiskImage::Directory* d = disk.openDirectory(path);
+            for (int i = 0; d && d->parent && i < d->parent->entryCount; i++) {
+                const DiskImage::Entry* pe = &d->parent->entries[i];
+                if (!pe->removed && pe->attr.dirent && pe->cluster == d->cluster) e = pe;
+            }
         }
-        strcpy(ext, cp);
-        cp--;
-    } else {
-        strcpy(ext, "   ");
-    }
-    if (8 < strlen(displayName)) {
-        puts("File not found (invalid name length)");
-        return 4;
-    }
-    strncpy(name, displayName, 8);
-    name[8] = 0;
-    ext[3] = 0;
-    int i;
-    for (i = 0; ext[i]; i++) ext[i] = toupper(ext[i]);
-    for (; i < 3; i++) ext[i] = ' ';
-    for (i = 0; name[i]; i++) name[i] = toupper(name[i]);
-    for (; i < 8; i++) name[i] = ' ';
-    if (cp) *cp = '.';
+        if (e) {
+            entries.push_back(e);
+        } else {
+            printf("%s: ", path);
+            result = diskError(4);
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+static int defrag(const char* order)
+{
+    std::vector<const DiskImage::Entry*> entries;
+    std::vector<bool> visited(disk.getMaxCluster() + 1);
+    // 指定が無い場合はディレクトリ順
+    if (order && 0 == strcasecmp(order, "name")) {
+        collectDefragEntries(disk.getRootDirectory(), true, entries, visited);
+    } else if (order && 0 == strcasecmp(order, "size")) {
+        collectDefragEntries(disk.getRootDirectory(), false, entries, visited);
+        std::stable_sort(entries.begin(), entries.end(), [](const DiskImage::Entry* a, const DiskImage::Entry* b) { return a->size < b->size; });
+    } else if (order) {
+        int result = loadDefragList(order, entries);
+        if (result) return result;
+    }
+    printFragments("Before");
+    if (!disk.defragment(entries.data(), (int)entries.size())) return diskError(-1);
+    printFragments("After");
     return 0;
 }
 
-static int get(const char* dsk, char* displayName, const char* getAs)
-{
-    char localFileName[16];
-    char name[9];
-    char ext[4];
-    int parseError = parseDisplayName(displayName, name, ext);
-    strcpy(localFileName, displayName);
-    if (parseError) return parseError;
-    if (!readDisk(dsk)) return 2;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (dir.entries[i].removed) continue;
-        if (strcmp(dir.entries[i].name, name) == 0) {
-            if (strcmp(dir.entries[i].ext, ext) == 0) {
-                FILE* fp = fopen(getAs ? getAs : localFileName, "wb");
-                wm(fp, nullptr, i);
-                fclose(fp);
-                return 0;
+static int execute(const char* dsk, int argc, char* argv[])
+{
+    if (0 == strcasecmp(argv[0], "info")) {
+        if (argc != 1) {
+            showUsage(BIT_INFO);
+            return 1;
+        }
+        if (!loadDisk(dsk, false)) return 2;
+        return DiskCommand::info(&disk);
+    } else if (0 == strcasecmp(argv[0], "ls") || 0 == strcasecmp(argv[0], "dir")) {
+        if (argc != 1 && argc != 2) {
+            showUsage(BIT_LS);
+            return 1;
+        }
+        if (!loadDisk(dsk, false)) return 2;
+        return DiskCommand::ls(&disk, 2 == argc ? argv[1] : nullptr);
+    } else if (0 == strcasecmp(argv[0], "cp") || 0 == strcmp(argv[0], "get")) {
+        if (argc != 2 && argc != 4) {
+            showUsage(BIT_CP);
+            return 1;
+        }
+        if (argc == 4 && 0 != strcasecmp(argv[2], "as")) {
+            showUsage(BIT_CP);
+            return 1;
+        }
+        if (!loadDisk(dsk, false)) return 2;
+        return DiskCommand::get(&disk, argv[1], 4 == argc ? argv[3] : nullptr);
+    } else if (0 == strcasecmp(argv[0], "wt") || 0 == strcasecmp(argv[0], "put")) {
+        if (argc != 2 && argc != 4) {
+            showUsage(BIT_WR);
+            return 1;
+        }
+        if (argc == 4 && 0 != strcasecmp(argv[2], "as")) {
+            showUsage(BIT_CP);
+            return 1;
+        }
+        if (!loadDisk(dsk, true)) return 2;
+        return DiskCommand::put(&disk, argv[1], 4 == argc ? argv[3] : nullptr, &basicCache);
+    } else if (0 == strcasecmp(argv[0], "cat")) {
+        if (argc != 2) {
+            showUsage(BIT_CAT);
+            return 1;
+        }
+        if (!loadDisk(dsk, false)) return 2;
+        return DiskCommand::cat(&disk, argv[1]);
+    } else if (0 == strcasecmp(argv[0], "rm") || 0 == strcasecmp(argv[0], "del") || 0 == strcasecmp(argv[0], "delete")) {
+        if (argc != 2) {
+            showUsage(BIT_RM);
+            return 1;
+        }
+        if (!loadDisk(dsk, true)) return 2;
+        return DiskCommand::rm(&disk, argv[1]);
+    } else if (0 == strcasecmp(argv[0], "mkdir") || 0 == strcasecmp(argv[0], "md")) {
+        if (argc != 2) {
+            showUsage(BIT_MKDIR);
+            return 1;
+        }
+        if (!loadDisk(dsk, true)) return 2;
+        return DiskCommand::makeDirectory(&disk, argv[1]);
+    } else if (0 == strcasecmp(argv[0], "extract")) {
+        bool textBas = false;
+        int jobs = 1;
+        for (int i = 2; i < argc; i++) {
+            if (0 == strcmp(argv[i], "--text-bas")) {
+                textBas = true;
+            } else if (0 == strcmp(argv[i], "-j") && i + 1 < argc && 0 < (jobs = atoi(argv[i + 1]))) {
+                i++;
+            } else {
+                argc = 0;
             }
         }
+        if (argc < 2) {
+            showUsage(BIT_EXTRACT);
+            return 1;
+        }
+        if (!loadDisk(dsk, false)) return 2;
+        return extract(argv[1], textBas, jobs);
+    } else if (0 == strcasecmp(argv[0], "sync")) {
+        if ((argc != 2 && argc != 3) || (argc == 3 && 0 != strcmp(argv[2], "--delete"))) {
+            showUsage(BIT_SYNC);
+            return 1;
+        }
+        if (!loadDisk(dsk, true)) return 2;
+        return syncHostDirectory(argv[1], argc == 3);
+    } else if (0 == strcasecmp(argv[0], "defrag")) {
+        if ((argc != 1 && argc != 3) || (argc == 3 && 0 != strcmp(argv[1], "--order"))) {
+            showUsage(BIT_DEFRAG);
+            return 1;
+        }
+        if (!loadDisk(dsk, true)) return 2;
+        return defrag(argc == 3 ? argv[2] : nullptr);
     }
-    puts("File not found");
-    return 4;
-}
-
-static int cat(const char* dsk, char* displayName)
-{
-    char name[9];
-    char ext[4];
-    int parseError = parseDisplayName(displayName, name, ext);
-    if (parseError) return parseError;
-    if (!readDisk(dsk)) return 2;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (dir.entries[i].removed) continue;
-        if (strcmp(dir.entries[i].name, name) == 0) {
-            if (strcmp(dir.entries[i].ext, ext) == 0) {
-                if (0 == strncmp(ext, "BAS", 3)) {
-                    unsigned char* buf = (unsigned char*)malloc(dir.entries[i].size);
-                    wm(nullptr, buf, i);
-                    bf.bas2txt(stdout, buf);
-                    free(buf);
-                } else {
-                    wm(stdout, nullptr, i);
-                }
-                return 0;
-            }
+    showUsage(BIT_ALL);
+    return 1;
+}
+
+static int batch(const char* dsk, const char* script)
+{
+    FILE* fp = 0 == strcmp(script, "-") ? stdin : fopen(script, "r");
+    if (!fp) {
+        printf("File not found: %s\n", script);
+        return 5;
+    }
+    if (!loadDisk(dsk, false)) {
+        if (fp != stdin) fclose(fp);
+        return 2;
+    }
+    // 全コマンドをメモリ上のイメージに適用し、全て成功した場合のみ最後に1回だけ書き戻す
+    char line[4096];
+    int lineNumber = 0;
+    int result = 0;
+    while (0 == result && fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        char* args[8];
+        int argc = 0;
+        for (char* cp = strtok(line, " \t\r\n"); cp; cp = strtok(NULL, " \t\r\n")) {
+            if ('#' == *cp) break;
+            if (argc < 8) args[argc] = cp;
+            argc++;
+        }
+        if (0 == argc) continue;
+        if (8 < argc || 0 == strcasecmp(args[0], "create") || 0 == strcasecmp(args[0], "batch")) {
+            showUsage(BIT_INFO | BIT_LS | BIT_CP | BIT_WR | BIT_CAT | BIT_RM | BIT_MKDIR | BIT_EXTRACT | BIT_SYNC | BIT_DEFRAG);
+            result = 1;
+        } else {
+            result = execute(dsk, argc, args);
+        }
+        if (result) {
+            printf("Batch aborted at line %d (disk image is not modified)\n", lineNumber);
         }
     }
-    puts("File not found");
-    return 4;
+    if (fp != stdin) fclose(fp);
+    if (0 == result && disk.isModified() && !disk.flush()) {
+        result = diskError(6);
+    }
+    return result;
+}
+
+// Disk image kept in memory by the serve command
+struct CachedImage {
+    std::string path;  // real path of the image file (key of the cache)
+    DiskImage disk;
+    std::mutex lock;   // held while a request uses the disk
+    int users;         // requests using (or waiting for) the image: not evicted while 0 < users
+    time_t modifiedAt; // time of the last modification not written back yet (0: not modified)
+    struct stat st;    // status of the file when loaded (or written back) to detect updates by other processes
+};
+
+// Connection handled by a thread (joined when it finished or the server stops)
+struct ServeClient {
+    int fd; // -1: closed by the thread
+    std::thread thread;
+    std::atomic<bool> finished;
+};
+
+static std::mutex serveLock;                 // guards serveCache, users, modifiedAt and serveClients (fd)
+static std::list<CachedImage*> serveCache;   // most recently used first
+static std::list<ServeClient*> serveClients; // connections being handled
+static size_t serveCacheSize;
+static volatile sig_atomic_t serveStopped;
+static const char* const serveConflict = "Disk image was modified by another process (unsaved changes are discarded)";
+
+static void stopServe(int)
+{
+    serveStopped = 1;
 }
 
-static bool setCreateFileInfo(int idx, const char* name, int nameLen, const char* ext, int extLen, unsigned char* data, size_t dataSize)
+static bool isSameFile(const struct stat& a, const struct stat& b)
 {
-    cfi.entries[idx].size = dataSize;
-    cfi.entries[idx].sectorSize = cfi.entries[idx].size / 512;
-    cfi.entries[idx].sectorSize += cfi.entries[idx].size % 512 != 0 ? 1 : 0;
-    cfi.entries[idx].clusterSize = cfi.entries[idx].sectorSize / 2;
-    cfi.entries[idx].clusterSize += cfi.entries[idx].sectorSize % 2;
-    cfi.totalSize += cfi.entries[idx].size;
-    cfi.totalSector += cfi.entries[idx].sectorSize;
-    cfi.totalCluster += cfi.entries[idx].clusterSize;
-    if ((1440 - 1 - 3 * 2 - 5) / 2 <= cfi.totalCluster) {
-        puts("Disk Full");
-        return false;
+#ifdef __APPLE__
+    long an = a.st_mtimespec.tv_nsec, bn = b.st_mtimespec.tv_nsec;
+#else
+    long an = a.st_mtim.tv_nsec, bn = b.st_mtim.tv_nsec;
+#endif
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size && a.st_mtime == b.st_mtime && an == bn;
+}
+
+// Write back the modified image (the caller holds image->lock)
+// - If another process has updated the file, the modifications are discarded instead of overwriting it
+static bool flushImage(CachedImage* image, const char** error = nullptr)
+{
+    if (!image->disk.isOpened() || !image->disk.isModified()) return true;
+    struct stat st;
+    const char* message = nullptr;
+    if (0 != stat(image->path.c_str(), &st) || !isSameFile(st, image->st)) {
+        image->disk.close();
+        message = serveConflict;
+    } else if (!image->disk.flush()) {
+        message = image->disk.getErrorMessage();
+    } else {
+        stat(image->path.c_str(), &image->st);
     }
-    cfi.entries[idx].data = data;
-    memset(cfi.entries[idx].name, 0x20, 8);
-    memcpy(cfi.entries[idx].name, name, nameLen < 8 ? nameLen : 8);
-    for (int i = 0; i < 8; i++) cfi.entries[idx].name[i] = toupper(cfi.entries[idx].name[i]);
-    memset(cfi.entries[idx].ext, 0x20, 3);
-    if (ext) {
-        memcpy(cfi.entries[idx].ext, ext, extLen < 3 ? extLen : 3);
-        for (int i = 0; i < 3; i++) cfi.entries[idx].ext[i] = toupper(cfi.entries[idx].ext[i]);
+    if (message) {
+        printf("%s: %s\n", image->path.c_str(), message);
+        fflush(stdout);
+        if (error) *error = message;
+        if (image->disk.isOpened()) return false; // I/O error: retry at the next write back
     }
-    return true;
+    std::lock_guard<std::mutex> guard(serveLock);
+    image->modifiedAt = 0;
+    return !message;
 }
 
-static bool addCreateFileInfo(const char* path, const char* putAs = nullptr)
+// Pick the least recently used images not in use over the cache size (the caller holds serveLock)
+// - The images are kept in the cache (users++) until written back, so a request for the same path waits for it
+static void evictImages(std::vector<CachedImage*>& evicted)
 {
-    if (MAX_FILES <= cfi.entryCount) {
-        puts("Disk Full");
-        return false;
+    size_t excess = serveCacheSize < serveCache.size() ? serveCache.size() - serveCacheSize : 0;
+    for (auto it = serveCache.rbegin(); 0 < excess && it != serveCache.rend(); ++it) {
+        if (0 == (*it)->users) {
+            (*it)->users++;
+            evicted.push_back(*it);
+            excess--;
+        }
     }
-    int idx = cfi.entryCount;
-    FILE* fp = fopen(path, "rb");
-    if (!fp) {
-        printf("File not found: %s\n", path);
-        return false;
+}
+
+// Write back the images picked by evictImages and free them (the caller holds no lock)
+static void closeImages(std::vector<CachedImage*>& evicted)
+{
+    for (auto* image : evicted) {
+        image->lock.lock();
+        flushImage(image);
+        image->lock.unlock();
+        std::lock_guard<std::mutex> guard(serveLock);
+        image->users--;
+        // 書き戻し中に他のリクエストが使用した場合、又は書き戻しに失敗した場合はキャッシュに残す
+        if (0 == image->users && 0 == image->modifiedAt && serveCacheSize < serveCache.size()) {
+            serveCache.remove(image);
+            delete image;
+        }
     }
-    fseek(fp, 0, SEEK_END);
-    cfi.entries[idx].size = (int)ftell(fp);
-    if (cfi.entries[idx].size < 1) {
-        puts("I/O error");
-        fclose(fp);
-        return false;
+}
+
+// Get the image from the cache (or load it) and lock it
+static CachedImage* acquireImage(const char* path, const char** error)
+{
+    char realPath[PATH_MAX];
+    if (!realpath(path, realPath)) {
+        *error = "File not found";
+        return nullptr;
     }
-    fseek(fp, 0, SEEK_SET);
-    unsigned char* bin = (unsigned char*)malloc(cfi.entries[idx].size + 1);
-    if (!bin) {
-        puts("No memory");
-        fclose(fp);
-        return false;
+    CachedImage* image = nullptr;
+    std::vector<CachedImage*> evicted;
+    {
+        std::lock_guard<std::mutex> guard(serveLock);
+        for (auto it = serveCache.begin(); it != serveCache.end(); ++it) {
+            if ((*it)->path == realPath) {
+                image = *it;
+                serveCache.erase(it);
+                break;
+            }
+        }
+        if (!image) {
+            image = new CachedImage();
+            image->path = realPath;
+            image->users = 0;
+            image->modifiedAt = 0;
+        }
+        image->users++;
+        serveCache.push_front(image);
+        evictImages(evicted);
     }
-    bin[cfi.entries[idx].size] = 0;
-    if (cfi.entries[idx].size != fread(bin, 1, cfi.entries[idx].size, fp)) {
-        puts("I/O error");
-        fclose(fp);
-        return false;
+    closeImages(evicted);
+    image->lock.lock();
+    // 未読み込み、又は他のプロセスがファイルを更新した場合は読み直す
+    struct stat st;
+    bool updated = 0 != stat(realPath, &st) || !isSameFile(st, image->st);
+    if (updated && image->disk.isModified()) {
+        // 未書き戻しの変更は新しいファイルに上書きできないため破棄する
+        printf("%s: %s\n", realPath, serveConflict);
+        fflush(stdout);
+        image->disk.close();
+        *error = serveConflict;
+        image->lock.unlock();
+        std::lock_guard<std::mutex> guard(serveLock);
+        image->modifiedAt = 0;
+        image->users--;
+        return nullptr;
     }
-    fclose(fp);
-    size_t basSize = 0;
-    unsigned char* bas = nullptr;
-    const char* name = strrchr(path, '/');
-    if (!name) name = strrchr(path, '\\');
-    name = name ? name + 1 : path;
-    const char* ext = strchr(name, '.');
-    int nameLen = ext ? (int)(ext - name) : (int)strlen(name);
-    int extLen = ext ? strlen(ext + 1) : 0;
-    ext = ext ? ext + 1 : 0;
-    if (3 == extLen && 0 == strncasecmp(ext, "BAS", 3)) {
-        bas = bf.txt2bas((char*)bin, &basSize);
-    }
-    if (bas) {
-        printf("%s: Convert to MSX-BASIC intermediate code ... %d -> %lu bytes", path, cfi.entries[idx].size, basSize);
-        cfi.entries[idx].size = (int)basSize;
-        free(bin);
-        bin = bas;
-    } else {
-        printf("%s: Write to disk as a binary file ... %d bytes", path, cfi.entries[idx].size);
-    }
-    if (putAs) {
-        printf(" as %s\n", putAs);
-        name = putAs;
-        ext = strchr(name, '.');
-        nameLen = ext ? (int)(ext - name) : (int)strlen(name);
-        extLen = ext ? strlen(ext + 1) : 0;
-        ext = ext ? ext + 1 : 0;
-    } else {
-        printf("\n");
+    if (!image->disk.isOpened() || updated) {
+        if (!image->disk.open(realPath, 0 == access(realPath, W_OK))) {
+            *error = image->disk.getErrorMessage();
+            image->lock.unlock();
+            std::lock_guard<std::mutex> guard(serveLock);
+            image->users--;
+            return nullptr;
+        }
+        image->st = st;
     }
-    memcpy(cfi.entries[cfi.entryCount].date, now(), 4);
-    if (!setCreateFileInfo(idx, name, nameLen, ext, extLen, bas ? bas : bin, cfi.entries[idx].size)) {
-        return false;
+    return image;
+}
+
+static void releaseImage(CachedImage* image, bool modified)
+{
+    std::vector<CachedImage*> evicted;
+    {
+        std::lock_guard<std::mutex> guard(serveLock);
+        if (modified) image->modifiedAt = time(nullptr);
+        image->lock.unlock();
+        image->users--;
+        evictImages(evicted);
     }
-    cfi.entryCount++;
-    return true;
+    closeImages(evicted);
 }
 
-static int create(const char* dskPath)
-{
-    // Create Boot Sector
-    unsigned char bootJump[3] = {0xEB, 0xFE, 0x90};
-    unsigned char bootJump2[2] = {0xD0, 0xED};
-    unsigned char dos1[0x1D0] = {
-        0xd0,                   // ret     nc                              ;[0030] d0
-        0xed, 0x53, 0x6a, 0xc0, // ld      ($c06a),de                      ;[0031] ed 53 6a c0
-        0x32, 0x72, 0xc0,       // ld      ($c072),a                       ;[0035] 32 72 c0
-        0x36, 0x67,             // ld      (hl),$67                        ;[0038] 36 67
-        0x23,                   // inc     hl                              ;[003a] 23
-        0x36, 0xc0,             // ld      (hl),$c0                        ;[003b] 36 c0
-        0x31, 0x1f, 0xf5,       // ld      sp,$f51f                        ;[003d] 31 1f f5
-        0x11, 0xab, 0xc0,       // ld      de,$c0ab                        ;[0040] 11 ab c0
-        0x0e, 0x0f,             // ld      c,$0f                           ;[0043] 0e 0f
-        0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0045] cd 7d f3
-        0x3c,                   // inc     a                               ;[0048] 3c
-        0x28, 0x26,             // jr      z,$0071                         ;[0049] 28 26
-        0x11, 0x00, 0x01,       // ld      de,$0100                        ;[004b] 11 00 01
-        0x0e, 0x1a,             // ld      c,$1a                           ;[004e] 0e 1a
-        0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0050] cd 7d f3
-        0x21, 0x01, 0x00,       // ld      hl,$0001                        ;[0053] 21 01 00
-        0x22, 0xb9, 0xc0,       // ld      ($c0b9),hl                      ;[0056] 22 b9 c0
-        0x21, 0x00, 0x3f,       // ld      hl,$3f00                        ;[0059] 21 00 3f
-        0x11, 0xab, 0xc0,       // ld      de,$c0ab                        ;[005c] 11 ab c0
-        0x0e, 0x27,             // ld      c,$27                           ;[005f] 0e 27
-        0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0061] cd 7d f3
-        0xc3, 0x00, 0x01,       // jp      $0100                           ;[0064] c3 00 01
-        0x69,                   // ld      l,c                             ;[0067] 69
-        0xc0,                   // ret     nz                              ;[0068] c0
-        0xcd, 0x00, 0x00,       // call    $0000                           ;[0069] cd 00 00
-        0x79,                   // ld      a,c                             ;[006c] 79
-        0xe6, 0xfe,             // and     $fe                             ;[006d] e6 fe
-        0xd6, 0x02,             // sub     $02                             ;[006f] d6 02
-        0xf6, 0x00,             // or      $00                             ;[0071] f6 00
-        0xca, 0x22, 0x40,       // jp      z,$4022                         ;[0073] ca 22 40
-        0x11, 0x85, 0xc0,       // ld      de,$c085                        ;[0076] 11 85 c0
-        0x0e, 0x09,             // ld      c,$09                           ;[0079] 0e 09
-        0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[007b] cd 7d f3
-        0x0e, 0x07,             // ld      c,$07                           ;[007e] 0e 07
-        0xcd, 0x7d, 0xf3,       // call    $f37d                           ;[0080] cd 7d f3
-        0x18, 0xb8,             // jr      $003d                           ;[0083] 18 b8
-        // 以下データ
-        0x42, 0x6F, 0x6F, 0x74, 0x20, 0x65, 0x72, 0x72, // Boot err
-        0x6F, 0x72, 0x0D, 0x0A, 0x50, 0x72, 0x65, 0x73, // or..Pres
-        0x73, 0x20, 0x61, 0x6E, 0x79, 0x20, 0x6B, 0x65, // s any ke
-        0x79, 0x20, 0x66, 0x6F, 0x72, 0x20, 0x72, 0x65, // y for re
-        0x74, 0x72, 0x79, 0x0D, 0x0A, 0x24, 0x00, 0x4D, // try..$.M
-        0x53, 0x58, 0x44, 0x4F, 0x53, 0x20, 0x20, 0x53, // SXDOS  S
-        0x59, 0x53,                                     // YS
-    };
-    unsigned char dos2[0x1D0] = {
-        0xC0, 0x0E, 0x0F, 0xCD, 0x7D, 0xF3, 0x3C, 0xCA, 0x63, 0xC0, 0x11, 0x00, 0x01, 0x0E, 0x1A, 0xCD,
-        0x7D, 0xF3, 0x21, 0x01, 0x00, 0x22, 0xB9, 0xC0, 0x21, 0x00, 0x3F, 0x11, 0xAB, 0xC0, 0x0E, 0x27,
-        0xCD, 0x7D, 0xF3, 0xC3, 0x00, 0x01, 0x58, 0xC0, 0xCD, 0x00, 0x00, 0x79, 0xE6, 0xFE, 0xFE, 0x02,
-        0xC2, 0x6A, 0xC0, 0x3A, 0xD0, 0xC0, 0xA7, 0xCA, 0x22, 0x40, 0x11, 0x85, 0xC0, 0xCD, 0x77, 0xC0,
-        0x0E, 0x07, 0xCD, 0x7D, 0xF3, 0x18, 0xB4, 0x1A, 0xB7, 0xC8, 0xD5, 0x5F, 0x0E, 0x06, 0xCD, 0x7D,
-        0xF3, 0xD1, 0x13, 0x18, 0xF2, 0x42, 0x6F, 0x6F, 0x74, 0x20, 0x65, 0x72, 0x72, 0x6F, 0x72, 0x0D,
-        0x0A, 0x50, 0x72, 0x65, 0x73, 0x73, 0x20, 0x61, 0x6E, 0x79, 0x20, 0x6B, 0x65, 0x79, 0x20, 0x66,
-        0x6F, 0x72, 0x20, 0x72, 0x65, 0x74, 0x72, 0x79, 0x0D, 0x0A, 0x00, 0x00, 0x4D, 0x53, 0x58, 0x44,
-        0x4F, 0x53, 0x20, 0x20, 0x53, 0x59, 0x53, 0x00};
-    srand((unsigned int)time(NULL));
-    memcpy(boot.bootJump, bootJump, 3);
-    memcpy(boot.oemName, "SZKPLN01", 8);
-    boot.sectorSize = 512;
-    boot.clusterSize = 2;
-    boot.fatPosition = 1;
-    boot.fatCopy = 2;
-    boot.directoryEntry = MAX_FILES;
-    boot.numberOfSector = 1440;
-    boot.mediaId = 0xF9;
-    boot.fatSize = 3;
-    boot.sectorPerTrack = 9;
-    boot.diskSides = 2;
-    boot.hiddenSector = 0;
-    memcpy(boot.bootJump2, bootJump2, 2);
-    memcpy(boot.idLabel, "VOL_ID", 6);
-    boot.dirtyFlag = 0x36;
-    if (0 == boot.idValue[0]) {
-        // 未設定の場合は乱数を設定 (put/rm向けに設定済みの場合は維持)
-        boot.idValue[0] = 0x01 | (rand() & 0xFE);
-        boot.idValue[1] = rand() & 0xFF;
-        boot.idValue[2] = rand() & 0xFF;
-        boot.idValue[3] = rand() & 0xFF;
-    }
-    memset(boot.reserved, 0, 5);
-    memcpy(boot.bootProgram, dos1, sizeof(dos1)); // 暫定的にDOS1のブートプログラムを設定
-    extractBootSectorToDisk();
-
-    // Create FAT
-    unsigned char* f = &diskImage[boot.fatPosition][0];
-    *f = 0xF9;
-    f++;
-    *f = 0xFF;
-    f++;
-    *f = 0xFF;
-    f++;
-    int c = 2;
-    int fs = 0;
-    for (int i = 0; i < cfi.entryCount; i++) {
-        // 最初のクラスタ番号はディレクトリエントリにのみ記憶
-        cfi.entries[i].clusterStart = (unsigned short)c++;
-        // 2番目以降のクラスタ番号をFATに記憶
-        for (int ii = 1; ii < cfi.entries[i].clusterSize; ii++) {
-            if (0 == fs) {
-                *f = (unsigned char)(c & 0xFF);
-                f++;
-                *f = ((unsigned char)(c & 0xF00)) >> 8;
-            } else {
-                (*f) |= ((unsigned char)(c & 0x00F)) << 4;
-                f++;
-                *f = (unsigned char)((c & 0xFF0) >> 4);
-                f++;
+// Write back the images not modified for idleSeconds
+static bool flushImages(int idleSeconds)
+{
+    std::vector<CachedImage*> targets;
+    {
+        std::lock_guard<std::mutex> guard(serveLock);
+        time_t now = time(nullptr);
+        for (auto* image : serveCache) {
+            if (image->modifiedAt && idleSeconds <= now - image->modifiedAt) {
+                image->users++;
+                targets.push_back(image);
             }
-            c++;
-            fs = 1 - fs;
-        }
-        // 終端コード (0xFFF)
-        if (0 == fs) {
-            *f = 0xFF;
-            f++;
-            *f = 0x0F;
-        } else {
-            *f |= 0xF0;
-            f++;
-            *f = 0xFF;
-            f++;
-        }
-        fs = 1 - fs;
-    }
-
-    // Copy FAT
-    for (int i = 1; i < boot.fatCopy; i++) {
-        memcpy(diskImage[boot.fatPosition + boot.fatSize * i], diskImage[boot.fatPosition], boot.fatSize * boot.sectorSize);
-    }
-
-    // Create Directory & File Content
-    bool isDOS1 = false;
-    bool isDOS2 = false;
-    unsigned char* d = &diskImage[boot.directoryPosition][0];
-    for (int i = 0; i < cfi.entryCount; i++) {
-        // Directory
-        memcpy(d, cfi.entries[i].name, 8);
-        d += 8;
-        memcpy(d, cfi.entries[i].ext, 3);
-        d += 3;
-        *d = 0;
-        d += 11;
-        memcpy(d, cfi.entries[i].date, 4);
-        d += 4;
-        memcpy(d, &cfi.entries[i].clusterStart, 2);
-        d += 2;
-        memcpy(d, &cfi.entries[i].size, 4);
-        d += 4;
-        // Check MSXDOS.SYS or MSXDOS2.SYS
-        if (0 == memcmp(cfi.entries[i].ext, "SYS", 3)) {
-            isDOS1 = 0 == memcmp(cfi.entries[i].name, "MSXDOS  ", 8);
-            isDOS2 = 0 == memcmp(cfi.entries[i].name, "MSXDOS2 ", 8);
-        }
-        // File Content
-        memcpy(diskImage[boot.dataPosition + (cfi.entries[i].clusterStart - 1) * boot.clusterSize], cfi.entries[i].data, cfi.entries[i].size);
-    }
-
-    // update boot program to DOS2 from DOS1
-    if (isDOS2) {
-        memcpy(boot.bootProgram, dos2, sizeof(dos2));
-        extractBootSectorToDisk();
-    }
-
-    // Write Disk Image
-    FILE* fp = fopen(dskPath, "wb");
-    if (NULL == fp) {
-        puts("I/O error");
-        return 6;
+        }
     }
-    if (sizeof(diskImage) != fwrite(diskImage, 1, sizeof(diskImage), fp)) {
-        puts("I/O error");
-        fclose(fp);
-        return 6;
+    bool result = true;
+    for (auto* image : targets) {
+        image->lock.lock();
+        if (!flushImage(image)) result = false;
+        releaseImage(image, false);
     }
-    fclose(fp);
-    return 0;
+    return result;
 }
 
-static int put(const char* dsk, char* path, const char* putAs)
+static bool sendResult(FILE* out, const void* data, size_t size)
 {
-    char displayName[4096];
-    char name[9];
-    char ext[4];
-    if (putAs) {
-        strcpy(displayName, putAs);
-    } else {
-        char* cp = strrchr(path, '/');
-        if (!cp) cp = strrchr(path, '\\');
-        cp = cp ? cp + 1 : path;
-        strcpy(displayName, cp);
-    }
-    int parseError = parseDisplayName(displayName, name, ext);
-    if (parseError) return parseError;
-    if (!readDisk(dsk)) return 2;
-    bool isOverwrite = false;
-    cfi.entryCount = 0;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (dir.entries[i].removed) continue;
-        if (strcasecmp(dir.entries[i].name, name) == 0 && strcasecmp(dir.entries[i].ext, ext) == 0) {
-            // 既存ファイルを更新
-            isOverwrite = true;
-            if (!addCreateFileInfo(path, putAs)) {
-                return -1;
+    fprintf(out, "OK %lu\n", (unsigned long)size);
+    if (size) fwrite(data, 1, size, out);
+    return 0 == fflush(out);
+}
+
+static bool sendError(FILE* out, const char* message)
+{
+    fprintf(out, "ERR %s\n", message);
+    return 0 == fflush(out);
+}
+
+// Handle a request (returns false to close the connection)
+static bool serveRequest(FILE* in, FILE* out, char* line, BasicFilter& filter)
+{
+    char* save;
+    char* args[4];
+    int argc = 0;
+    for (char* cp = strtok_r(line, " \t\r\n", &save); cp; cp = strtok_r(nullptr, " \t\r\n", &save)) {
+        if (argc < 4) args[argc] = cp;
+        argc++;
+    }
+    if (0 == argc) return true;
+    const char* command = args[0];
+    if (0 == strcasecmp(command, "flush") && argc <= 2) {
+        if (1 == argc) {
+            return flushImages(0) ? sendResult(out, nullptr, 0) : sendError(out, "I/O error");
+        }
+        const char* error;
+        CachedImage* image = acquireImage(args[1], &error);
+        if (!image) return sendError(out, error);
+        bool result = flushImage(image, &error);
+        releaseImage(image, false);
+        return result ? sendResult(out, nullptr, 0) : sendError(out, error);
+    }
+
+    // put は先にデータを受信する (エラーの場合も次のリクエストを読めるように)
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    if (0 == strcasecmp(command, "put") && 4 == argc) {
+        char* end;
+        size = strtoul(args[3], &end, 10);
+        // 不正なサイズの場合は後続のデータを読み飛ばせないため切断する
+        if (*end || 16 * 1024 * 1024 < size) {
+            sendError(out, "Invalid request");
+            return false;
+        }
+        data = (unsigned char*)malloc(size + 1);
+        if (!data) {
+            sendError(out, "No memory");
+            return false;
+        }
+        if (size != fread(data, 1, size, in)) {
+            free(data);
+            return false;
+        }
+        data[size] = 0;
+        if (DiskCommand::isBasicFileName(args[2]) && 0 < size) {
+            size_t basSize = 0;
+            unsigned char* bas = basicCache.txt2bas(filter, (char*)data, size, &basSize);
+            if (bas) {
+                free(data);
+                data = bas;
+                size = basSize;
             }
+        }
+    } else if (!(0 == strcasecmp(command, "ls") && (2 == argc || 3 == argc)) && !(3 == argc && (0 == strcasecmp(command, "get") || 0 == strcasecmp(command, "cat") || 0 == strcasecmp(command, "rm") || 0 == strcasecmp(command, "mkdir")))) {
+        return sendError(out, "Invalid request");
+    }
+
+    const char* error = nullptr;
+    CachedImage* image = acquireImage(args[1], &error);
+    if (!image) {
+        free(data);
+        return sendError(out, error);
+    }
+    DiskImage* disk = &image->disk;
+    char* result = nullptr;
+    size_t resultSize = 0;
+    bool modified = false;
+    if (0 == strcasecmp(command, "ls")) {
+        const DiskImage::Directory* d = disk->openDirectory(3 == argc ? args[2] : nullptr);
+        FILE* fp = d ? open_memstream(&result, &resultSize) : nullptr;
+        if (fp) {
+            DiskCommand::printDirectory(fp, disk, d);
+            fclose(fp);
         } else {
-            // 既存ファイルをそのまま維持
-            unsigned char* data = (unsigned char*)malloc(dir.entries[i].size);
-            if (!data) {
-                puts("No memory");
-                return -1;
-            }
-            wm(nullptr, data, i);
-            memcpy(cfi.entries[cfi.entryCount].date, dir.entries[i].dateRaw, 4);
-            if (!setCreateFileInfo(cfi.entryCount++, dir.entries[i].name, 8, dir.entries[i].ext, 3, data, dir.entries[i].size)) {
-                return -1;
+            error = d ? "No memory" : disk->getErrorMessage();
+        }
+    } else if (0 == strcasecmp(command, "get") || 0 == strcasecmp(command, "cat")) {
+        const DiskImage::Entry* e = disk->findFile(args[2]);
+        unsigned char* buf = e ? (unsigned char*)calloc(1, e->size + 3) : nullptr;
+        if (buf && !disk->read(e, buf)) {
+            free(buf);
+            buf = nullptr;
+            error = disk->getErrorMessage();
+        } else if (buf) {
+            resultSize = e->size;
+            if (0 == strcasecmp(command, "cat") && 0 == strncmp(e->ext, "BAS", 3) && 0xFF == buf[0]) {
+                result = filter.bas2txt(buf, &resultSize);
+                free(buf);
+            } else {
+                result = (char*)buf;
             }
         }
-    }
-    if (!isOverwrite) {
-        if (!addCreateFileInfo(path, putAs)) {
-            return -1;
+        if (!result && !error) error = e ? "No memory" : disk->getErrorMessage();
+    } else {
+        if (0 == strcasecmp(command, "put")) {
+            modified = disk->write(args[2], data, size);
+        } else if (0 == strcasecmp(command, "rm")) {
+            modified = disk->remove(args[2]);
+        } else {
+            modified = disk->makeDirectory(args[2]);
         }
+        if (!modified) error = disk->getErrorMessage();
     }
-    memset(diskImage, 0, sizeof(diskImage));
-    return create(dsk);
+    releaseImage(image, modified);
+    free(data);
+    bool sent = error ? sendError(out, error) : sendResult(out, result, resultSize);
+    free(result);
+    return sent;
 }
 
-static int rm(const char* dsk, char* path)
+static void serveClient(ServeClient* client)
 {
-    char displayName[4096];
-    char name[9];
-    char ext[4];
-    char* cp = strrchr(path, '/');
-    if (!cp) cp = strrchr(path, '\\');
-    cp = cp ? cp + 1 : path;
-    strcpy(displayName, cp);
-    int parseError = parseDisplayName(displayName, name, ext);
-    if (parseError) return parseError;
-    if (!readDisk(dsk)) return 2;
-    bool removed = false;
-    cfi.entryCount = 0;
-    for (int i = 0; i < dir.entryCount; i++) {
-        if (dir.entries[i].removed) continue;
-        if (strcasecmp(dir.entries[i].name, name) == 0 && strcasecmp(dir.entries[i].ext, ext) == 0) {
-            removed = true;
-        } else {
-            // 既存ファイルをそのまま維持
-            unsigned char* data = (unsigned char*)malloc(dir.entries[i].size);
-            if (!data) {
-                puts("No memory");
-                return -1;
-            }
-            wm(nullptr, data, i);
-            memcpy(cfi.entries[cfi.entryCount].date, dir.entries[i].dateRaw, 4);
-            if (!setCreateFileInfo(cfi.entryCount++, dir.entries[i].name, 8, dir.entries[i].ext, 3, data, dir.entries[i].size)) {
-                return -1;
+    int fd = client->fd;
+    FILE* in = fdopen(fd, "r");
+    int dupFd = in ? dup(fd) : -1;
+    FILE* out = 0 <= dupFd ? fdopen(dupFd, "w") : nullptr;
+    BasicFilter filter;
+    char line[4096];
+    while (out && fgets(line, sizeof(line), in)) {
+        if (!serveRequest(in, out, line, filter)) break;
+    }
+    {
+        // 停止時に shutdown されないように閉じる前に外す
+        std::lock_guard<std::mutex> guard(serveLock);
+        client->fd = -1;
+    }
+    if (out) {
+        fclose(out);
+    } else if (0 <= dupFd) {
+        close(dupFd);
+    }
+    if (in) {
+        fclose(in);
+    } else {
+        close(fd);
+    }
+    client->finished = true;
+}
+
+// Join the threads of the closed connections (all: shut down the others and wait for them)
+static void joinClients(bool all)
+{
+    std::vector<ServeClient*> finished;
+    {
+        std::lock_guard<std::mutex> guard(serveLock);
+        for (auto it = serveClients.begin(); it != serveClients.end();) {
+            if (all && 0 <= (*it)->fd) shutdown((*it)->fd, SHUT_RDWR);
+            if (all || (*it)->finished) {
+                finished.push_back(*it);
+                it = serveClients.erase(it);
+            } else {
+                ++it;
             }
         }
     }
-    if (!removed) {
-        puts("File not found");
-        return -1;
+    for (auto* client : finished) {
+        client->thread.join();
+        delete client;
+    }
+}
+
+static int serve(const char* socketPath, int cacheSize, int idleSeconds)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (sizeof(addr.sun_path) <= strlen(socketPath)) {
+        printf("Invalid socket path: %s\n", socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    // 前回の終了時に残ったソケットは削除する (起動中のサーバが応答する場合はエラー)
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (0 <= fd && 0 == connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        printf("Already serving: %s\n", socketPath);
+        close(fd);
+        return 1;
+    }
+    if (0 <= fd) close(fd);
+    struct stat st;
+    if (0 == stat(socketPath, &st) && S_ISSOCK(st.st_mode)) unlink(socketPath);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || 0 != bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || 0 != listen(fd, 64)) {
+        printf("I/O error: %s\n", socketPath);
+        if (0 <= fd) close(fd);
+        return 6;
+    }
+    serveCacheSize = (size_t)cacheSize;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopServe;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving on %s (cache: %d images, write back: %d seconds after the last modification)\n", socketPath, cacheSize, idleSeconds);
+    fflush(stdout);
+
+    // 1秒毎にアイドル状態のイメージを書き戻しながら接続を受け付ける
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!serveStopped) {
+        pfd.revents = 0;
+        if (0 < poll(&pfd, 1, 1000) && (pfd.revents & POLLIN)) {
+            int clientFd = accept(fd, nullptr, nullptr);
+            if (0 <= clientFd) {
+                ServeClient* client = new ServeClient();
+                client->fd = clientFd;
+                client->finished = false;
+                {
+                    std::lock_guard<std::mutex> guard(serveLock);
+                    serveClients.push_back(client);
+                }
+                client->thread = std::thread(serveClient, client);
+            }
+        }
+        joinClients(false);
+        flushImages(idleSeconds);
     }
-    memset(diskImage, 0, sizeof(diskImage));
-    return create(dsk);
+    // 受け付けを止めて処理中のリクエストの完了を待ってから全て書き戻す
+    close(fd);
+    unlink(socketPath);
+    joinClients(true);
+    bool result = flushImages(0);
+    puts("Stopped");
+    return result ? 0 : 6;
 }
 
 int main(int argc, char* argv[])
@@ -899,69 +1119,66 @@ int main(int argc, char* argv[])
         return 255;
     }
     if (argc < 3) {
-        showUsage(0xFF);
+        showUsage(BIT_ALL);
         return 1;
     }
-    if (0 == strcasecmp(argv[2], "info")) {
-        if (argc != 3) {
-            showUsage(BIT_INFO);
-            return 1;
-        }
-        return info(argv[1]);
-    } else if (0 == strcasecmp(argv[2], "ls") || 0 == strcasecmp(argv[2], "dir")) {
-        if (argc != 3) {
-            showUsage(BIT_LS);
-            return 1;
-        }
-        return ls(argv[1]);
-    } else if (0 == strcasecmp(argv[2], "cp") || 0 == strcmp(argv[2], "get")) {
-        if (argc != 4 && argc != 6) {
-            showUsage(BIT_CP);
-            return 1;
-        }
-        if (argc == 6 && 0 != strcasecmp(argv[4], "as")) {
-            showUsage(BIT_CP);
-            return 1;
-        }
-        return get(argv[1], argv[3], 6 == argc ? argv[5] : nullptr);
-    } else if (0 == strcasecmp(argv[2], "wt") || 0 == strcasecmp(argv[2], "put")) {
-        if (argc != 4 && argc != 6) {
-            showUsage(BIT_WR);
-            return 1;
-        }
-        if (argc == 6 && 0 != strcasecmp(argv[4], "as")) {
-            showUsage(BIT_CP);
-            return 1;
+    // テキスト形式の BASIC の変換結果を再利用するキャッシュ (--cache-dir で上書き可能)
+    const char* cacheDir = getenv("DSKMGR_CACHE_DIR");
+    if (cacheDir && *cacheDir && !basicCache.setDirectory(cacheDir)) {
+        // 変換しないコマンドもあるため、使えない場合はキャッシュ無しで続行する
+        fprintf(stderr, "Warning: DSKMGR_CACHE_DIR is not usable (%s), so the cache is disabled\n", cacheDir);
+    }
+    if (0 == strcasecmp(argv[1], "serve") && '-' == argv[2][0]) {
+        const char* socketPath = nullptr;
+        int cacheSize = 16;
+        int idleSeconds = 2;
+        for (int i = 2; i < argc; i += 2) {
+            if (i + 1 < argc && 0 == strcmp(argv[i], "--socket")) {
+                socketPath = argv[i + 1];
+            } else if (i + 1 < argc && 0 == strcmp(argv[i], "--cache") && 0 < (cacheSize = atoi(argv[i + 1]))) {
+                continue;
+            } else if (i + 1 < argc && 0 == strcmp(argv[i], "--idle") && isdigit(argv[i + 1][0])) {
+                idleSeconds = atoi(argv[i + 1]);
+            } else if (i + 1 < argc && 0 == strcmp(argv[i], "--cache-dir") && basicCache.setDirectory(argv[i + 1])) {
+                continue;
+            } else {
+                socketPath = nullptr;
+                break;
+            }
         }
-        memset(&cfi, 0, sizeof(cfi));
-        return put(argv[1], argv[3], 6 == argc ? argv[5] : nullptr);
-    } else if (0 == strcasecmp(argv[2], "cat")) {
-        if (argc != 4) {
-            showUsage(BIT_CAT);
+        if (!socketPath) {
+            showUsage(BIT_SERVE);
             return 1;
         }
-        return cat(argv[1], argv[3]);
-    } else if (0 == strcasecmp(argv[2], "rm") || 0 == strcasecmp(argv[2], "del") || 0 == strcasecmp(argv[2], "delete")) {
+        return serve(socketPath, cacheSize, idleSeconds);
+    }
+    if (0 == strcasecmp(argv[2], "batch")) {
         if (argc != 4) {
-            showUsage(BIT_RM);
+            showUsage(BIT_BATCH);
             return 1;
         }
-        return rm(argv[1], argv[3]);
+        int result = batch(argv[1], argv[3]);
+        disk.close();
+        return result;
     } else if (0 == strcasecmp(argv[2], "create")) {
-        if (argc < 3) {
+        DiskImage::Format format = DiskImage::formats[1];
+        int jobs = 1;
+        int i = 3;
+        for (; i + 1 < argc && '-' == argv[i][0]; i += 2) {
+            if (0 == strcmp(argv[i], "-f") && DiskImage::parseFormat(argv[i + 1], &format)) continue;
+            if (0 == strcmp(argv[i], "-j") && 0 < (jobs = atoi(argv[i + 1]))) continue;
+            if (0 == strcmp(argv[i], "--cache-dir") && basicCache.setDirectory(argv[i + 1])) continue;
             showUsage(BIT_CREATE);
             return 1;
         }
-        memset(&cfi, 0, sizeof(cfi));
-        for (int i = 3; i < argc; i++) {
-            if (!addCreateFileInfo(argv[i])) {
-                return 5;
-            }
-        }
-        return create(argv[1]);
-    } else {
-        showUsage(0xFF);
-        return 1;
+        int result = create(argv[1], format, &argv[i], argc - i, jobs);
+        disk.close();
+        return result;
     }
-    return 0;
+    int result = execute(argv[1], argc - 2, &argv[2]);
+    if (0 == result && disk.isModified() && !disk.flush()) {
+        result = diskError(6);
+    }
+    disk.close();
+    return result;
 }
@@ -0,0 +1,156 @@
+/**
+ * SUZUKI PLAN - FAT12 Codec
+ * Pack and unpack of the 12-bit File Allocation Table entries
+ * -----------------------------------------------------------------------------
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Yoji Suzuki.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ */
+#ifndef INCLUDE_FAT12_HPP
+#define INCLUDE_FAT12_HPP
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FAT12_USE_SSSE3
+#include <immintrin.h>
+#endif
+
+// FAT12 stores two 12-bit entries in each 3-byte group:
+//   byte0 = e0[7:0], byte1 = e1[3:0] << 4 | e0[11:8], byte2 = e1[11:4]
+class FAT12
+{
+  public:
+    // Get the entry of index from the packed table
+    static inline unsigned short get(const unsigned char* fat, int index)
+    {
+        const unsigned char* p = fat + index + index / 2;
+        if (index & 1) {
+            return (unsigned short)((p[0] >> 4) | (p[1] << 4));
+        } else {
+            return (unsigned short)(p[0] | ((p[1] & 0x0F) << 8));
+        }
+    }
+
+    // Set the entry of index to the packed table (the neighbour nibble is kept)
+    static inline void set(unsigned char* fat, int index, unsigned short value)
+    {
+        unsigned char* p = fat + index + index / 2;
+        if (index & 1) {
+            p[0] = (unsigned char)((p[0] & 0x0F) | ((value & 0x00F) << 4));
+            p[1] = (unsigned char)((value & 0xFF0) >> 4);
+        } else {
+            p[0] = (unsigned char)(value & 0xFF);
+            p[1] = (unsigned char)((p[1] & 0xF0) | ((value & 0xF00) >> 8));
+        }
+    }
+
+    // Unpack count entries from src ((count * 3 + 1) / 2 bytes) to dst
+    static void decode(const unsigned char* src, unsigned short* dst, int count)
+    {
+        int i = 0;
+#ifdef FAT12_USE_SSSE3
+        if (hasSSSE3()) i = decodeSSSE3(src, dst, count);
+#endif
+        decodeScalar(src + i / 2 * 3, dst + i, count - i);
+    }
+
+    // Pack count entries from src to dst ((count * 3 + 1) / 2 bytes)
+    static void encode(const unsigned short* src, unsigned char* dst, int count)
+    {
+        int i = 0;
+#ifdef FAT12_USE_SSSE3
+        if (hasSSSE3()) i = encodeSSSE3(src, dst, count);
+#endif
+        encodeScalar(src + i, dst + i / 2 * 3, count - i);
+    }
+
+    static void decodeScalar(const unsigned char* src, unsigned short* dst, int count)
+    {
+        for (; 2 <= count; count -= 2, src += 3, dst += 2) {
+            dst[0] = (unsigned short)(src[0] | ((src[1] & 0x0F) << 8));
+            dst[1] = (unsigned short)((src[1] >> 4) | (src[2] << 4));
+        }
+        if (count) {
+            dst[0] = (unsigned short)(src[0] | ((src[1] & 0x0F) << 8));
+        }
+    }
+
+    static void encodeScalar(const unsigned short* src, unsigned char* dst, int count)
+    {
+        for (; 2 <= count; count -= 2, src += 2, dst += 3) {
+            dst[0] = (unsigned char)(src[0] & 0xFF);
+            dst[1] = (unsigned char)(((src[0] & 0xF00) >> 8) | ((src[1] & 0x00F) << 4));
+            dst[2] = (unsigned char)((src[1] & 0xFF0) >> 4);
+        }
+        if (count) {
+            set(dst, 0, src[0]);
+        }
+    }
+
+  private:
+#ifdef FAT12_USE_SSSE3
+    static bool hasSSSE3()
+    {
+        static const bool result = __builtin_cpu_supports("ssse3");
+        return result;
+    }
+
+    // 8 entries (12 bytes) per shuffle, returns the number of decoded entries
+    __attribute__((target("ssse3"))) static int decodeSSSE3(const unsigned char* src, unsigned short* dst, int count)
+    {
+        // lane 2n = bytes (3n, 3n+1), lane 2n+1 = bytes (3n+1, 3n+2)
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+        const __m128i evenMask = _mm_setr_epi16(0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0);
+        const __m128i oddMask = _mm_setr_epi16(0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF, 0, 0x0FFF);
+        int i = 0;
+        // 16 bytes are loaded for 12 bytes of input, so stop while 11 entries (17 bytes) remain
+        for (; i + 11 <= count; i += 8, src += 12, dst += 8) {
+            __m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), shuffle);
+            __m128i even = _mm_and_si128(v, evenMask);
+            __m128i odd = _mm_and_si128(_mm_srli_epi16(v, 4), oddMask);
+            _mm_storeu_si128((__m128i*)dst, _mm_or_si128(even, odd));
+        }
+        return i;
+    }
+
+    // 8 entries (12 bytes) per shuffle, returns the number of encoded entries
+    __attribute__((target("ssse3"))) static int encodeSSSE3(const unsigned short* src, unsigned char* dst, int count)
+    {
+        // each 32-bit lane holds a pair: e0 | e1 << 12 (24 bits), then drop the 4th byte
+        const __m128i lowMask = _mm_set1_epi32(0x00000FFF);
+        const __m128i highMask = _mm_set1_epi32(0x00FFF000);
+        const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        int i = 0;
+        for (; i + 8 <= count; i += 8, src += 8, dst += 12) {
+            __m128i v = _mm_loadu_si128((const __m128i*)src);
+            __m128i p = _mm_or_si128(_mm_and_si128(v, lowMask), _mm_and_si128(_mm_srli_epi32(v, 4), highMask));
+            p = _mm_shuffle_epi8(p, shuffle);
+            _mm_storel_epi64((__m128i*)dst, p);
+            int tail = _mm_cvtsi128_si32(_mm_srli_si128(p, 8));
+            memcpy(dst + 8, &tail, 4);
+        }
+        return i;
+    }
+#endif
+};
+
+#endif // INCLUDE_FAT12_HPP